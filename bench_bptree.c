@@ -0,0 +1,1075 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "bptree.h"
+
+// Benchmark driver for the B+tree library
+// Build with optimization, e.g.: make clean && make bench OPT="-O2 -DN=64"
+
+#define DEFAULT_KEYS 1000000
+
+#define SNAPSHOT_PATH "/tmp/bench_bptree.snap"
+
+#define SHM_NAME "/bench_bptree"
+
+static double now_sec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// xorshift64 so runs are reproducible across platforms
+static unsigned long long rng_state = 88172645463325252ULL;
+
+static unsigned long long next_rand(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static void shuffle(int *keys, int n) {
+    int i, j, tmp;
+
+    for (i = n - 1; i > 0; i--) {
+        j = (int)(next_rand() % (unsigned long long)(i + 1));
+        tmp = keys[i];
+        keys[i] = keys[j];
+        keys[j] = tmp;
+    }
+}
+
+// Fill keys with 0..n-1 in the requested order
+static void make_keys(int *keys, int n, const char *pattern) {
+    int i;
+
+    for (i = 0; i < n; i++) {
+        keys[i] = strcmp(pattern, "reverse") == 0 ? n - 1 - i : i;
+    }
+    if (strcmp(pattern, "random") == 0) {
+        shuffle(keys, n);
+    }
+}
+
+// Insert throughput and memory use for sequential, reverse and random keys
+static void bench_insert(int n) {
+    const char *patterns[] = {"sequential", "reverse", "random"};
+    int *keys;
+    int p, i;
+
+    if (!(keys = (int *)malloc(sizeof(int) * n))) ERR;
+
+    printf("insert: n=%d N=%d sizeof(NODE)=%zu\n", n, N, sizeof(NODE));
+    printf("%-12s %12s %10s %10s %12s %10s\n",
+           "pattern", "Mops/s", "nodes", "leaves", "bytes/key", "leaf fill");
+
+    for (p = 0; p < 3; p++) {
+        STATS stats;
+        double start, elapsed;
+
+        make_keys(keys, n, patterns[p]);
+        bptree_init();
+
+        start = now_sec();
+        for (i = 0; i < n; i++) {
+            bptree_insert(keys[i], NULL);
+        }
+        elapsed = now_sec() - start;
+
+        bptree_stats(&stats);
+        printf("%-12s %12.2f %10lld %10lld %12.1f %9.1f%%\n",
+               patterns[p], n / elapsed / 1e6, stats.num_nodes, stats.num_leaves,
+               (double)stats.bytes / stats.num_keys, stats.leaf_fill * 100);
+
+        bptree_destroy();
+    }
+
+    free(keys);
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Print mean/p50/p99/p99.9/max of per-operation latencies in nanoseconds
+static void print_latency(const char *name, double *lat, int n) {
+    double sum = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        sum += lat[i];
+    }
+    qsort(lat, n, sizeof(double), compare_double);
+    printf("%-12s %10.0f %10.0f %10.0f %10.0f %12.0f\n", name, sum / n,
+           lat[n / 2], lat[(int)(n * 0.99)], lat[(int)(n * 0.999)], lat[n - 1]);
+}
+
+// Per-insert latency of bottom-up versus top-down splitting on random keys
+static void bench_latency(int n) {
+    const char *names[] = {"bottom-up", "top-down"};
+    double *lat;
+    int *keys;
+    int m, i;
+
+    if (!(keys = (int *)malloc(sizeof(int) * n))) ERR;
+    if (!(lat = (double *)malloc(sizeof(double) * n))) ERR;
+    make_keys(keys, n, "random");
+
+    printf("latency: n=%d N=%d (ns)\n", n, N);
+    printf("%-12s %10s %10s %10s %10s %12s\n",
+           "insert", "mean", "p50", "p99", "p99.9", "max");
+
+    for (m = 0; m < 2; m++) {
+        bptree_init();
+        for (i = 0; i < n; i++) {
+            double start = now_sec();
+            if (m == 0) {
+                bptree_insert(keys[i], NULL);
+            } else {
+                bptree_insert_topdown(keys[i], NULL);
+            }
+            lat[i] = (now_sec() - start) * 1e9;
+        }
+        print_latency(names[m], lat, n);
+        bptree_destroy();
+    }
+
+    free(lat);
+    free(keys);
+}
+
+// Cold build of random keys: serial inserts versus parallel bulk load
+static void bench_bulk(int n) {
+    int threads[] = {1, 2, 4, 8, 16, 32};
+    double start, serial, elapsed;
+    int *keys;
+    int t, i;
+
+    if (!(keys = (int *)malloc(sizeof(int) * n))) ERR;
+    make_keys(keys, n, "random");
+
+    printf("bulk: n=%d N=%d\n", n, N);
+    printf("%-16s %10s %10s %10s\n", "build", "seconds", "Mkeys/s", "speedup");
+
+    bptree_init();
+    start = now_sec();
+    for (i = 0; i < n; i++) {
+        bptree_insert(keys[i], NULL);
+    }
+    serial = now_sec() - start;
+    printf("%-16s %10.3f %10.2f %10.2f\n", "bptree_insert", serial, n / serial / 1e6, 1.0);
+    bptree_destroy();
+
+    for (t = 0; t < (int)(sizeof(threads) / sizeof(threads[0])); t++) {
+        char name[32];
+
+        start = now_sec();
+        bptree_bulk_load(keys, NULL, n, threads[t]);
+        elapsed = now_sec() - start;
+
+        snprintf(name, sizeof(name), "bulk %d threads", threads[t]);
+        printf("%-16s %10.3f %10.2f %10.2f\n", name, elapsed, n / elapsed / 1e6, serial / elapsed);
+        bptree_destroy();
+    }
+
+    free(keys);
+}
+
+// Full-range and 1%-selectivity aggregates with 1 to 32 threads
+static void bench_pscan(int n) {
+    int threads[] = {1, 2, 4, 8, 16, 32};
+    const char *names[] = {"full", "1%"};
+    double start, elapsed, base[2];
+    AGGREGATE agg;
+    int *keys;
+    int t, r, lo, hi;
+
+    if (!(keys = (int *)malloc(sizeof(int) * n))) ERR;
+    make_keys(keys, n, "random");
+    bptree_bulk_load(keys, NULL, n, 1);
+
+    printf("pscan: n=%d N=%d\n", n, N);
+    printf("%-6s %8s %10s %10s %10s %12s\n", "range", "threads", "ms", "Mkeys/s", "speedup", "count");
+
+    for (r = 0; r < 2; r++) {
+        lo = r == 0 ? 0 : n / 2;
+        hi = r == 0 ? n - 1 : n / 2 + n / 100;
+        for (t = 0; t < (int)(sizeof(threads) / sizeof(threads[0])); t++) {
+            start = now_sec();
+            bptree_parallel_aggregate(lo, hi, threads[t], &agg);
+            elapsed = now_sec() - start;
+            if (t == 0) {
+                base[r] = elapsed;
+            }
+            printf("%-6s %8d %10.2f %10.2f %10.2f %12lld\n", names[r], threads[t], elapsed * 1e3,
+                   agg.count / elapsed / 1e6, base[r] / elapsed, agg.count);
+        }
+    }
+
+    bptree_destroy();
+    free(keys);
+}
+
+// Random point lookups: bptree_get loop versus bptree_multi_get batches
+static void bench_mget(int n) {
+    int batches[] = {1, 2, 4, 8, 16, 32, 64};
+    int queries = 4000000;
+    double start, elapsed, base;
+    DATA *out[64];
+    int *keys, *probe;
+    int b, i, found;
+
+    if (!(keys = (int *)malloc(sizeof(int) * n))) ERR;
+    if (!(probe = (int *)malloc(sizeof(int) * queries))) ERR;
+    make_keys(keys, n, "random");
+    bptree_bulk_load(keys, NULL, n, 1);
+    for (i = 0; i < queries; i++) {
+        probe[i] = (int)(next_rand() % (unsigned long long)n);
+    }
+
+    printf("mget: n=%d N=%d tree=%.0f MB queries=%d\n", n, N,
+           (double)n / (N - 1) * sizeof(NODE) / 1e6, queries);
+    printf("%-12s %10s %10s %10s\n", "lookup", "Mops/s", "ns/op", "speedup");
+
+    start = now_sec();
+    for (i = 0, found = 0; i < queries; i++) {
+        found += bptree_get(probe[i], NULL);
+    }
+    base = now_sec() - start;
+    printf("%-12s %10.2f %10.1f %10.2f\n", "bptree_get", queries / base / 1e6, base * 1e9 / queries, 1.0);
+
+    for (b = 0; b < (int)(sizeof(batches) / sizeof(batches[0])); b++) {
+        char name[32];
+
+        start = now_sec();
+        for (i = 0, found = 0; i + batches[b] <= queries; i += batches[b]) {
+            found += bptree_multi_get(probe + i, batches[b], out);
+        }
+        elapsed = now_sec() - start;
+
+        snprintf(name, sizeof(name), "batch %d", batches[b]);
+        printf("%-12s %10.2f %10.1f %10.2f\n", name, i / elapsed / 1e6, elapsed * 1e9 / i, base / elapsed);
+        if (found != i) {
+            fprintf(stderr, "mget: found %d of %d keys\n", found, i);
+        }
+    }
+
+    bptree_destroy();
+    free(probe);
+    free(keys);
+}
+
+// Random insert/lookup/delete throughput of the compiled leaf format
+static void bench_leaf(int n) {
+    double start, elapsed;
+    int *keys;
+    int i, found = 0;
+
+    if (!(keys = (int *)malloc(sizeof(int) * n))) ERR;
+    make_keys(keys, n, "random");
+
+#ifdef BPTREE_UNSORTED_LEAVES
+    printf("leaf: n=%d N=%d format=unsorted+fingerprint\n", n, N);
+#else
+    printf("leaf: n=%d N=%d format=sorted\n", n, N);
+#endif
+    printf("%-8s %10s\n", "op", "Mops/s");
+
+    bptree_init();
+    start = now_sec();
+    for (i = 0; i < n; i++) {
+        bptree_insert(keys[i], NULL);
+    }
+    elapsed = now_sec() - start;
+    printf("%-8s %10.2f\n", "insert", n / elapsed / 1e6);
+
+    shuffle(keys, n);
+    start = now_sec();
+    for (i = 0; i < n; i++) {
+        found += bptree_get(keys[i], NULL);
+    }
+    elapsed = now_sec() - start;
+    printf("%-8s %10.2f\n", "lookup", n / elapsed / 1e6);
+
+    shuffle(keys, n);
+    start = now_sec();
+    for (i = 0; i < n; i++) {
+        bptree_delete(keys[i]);
+    }
+    elapsed = now_sec() - start;
+    printf("%-8s %10.2f\n", "delete", n / elapsed / 1e6);
+
+    if (found != n) {
+        fprintf(stderr, "leaf: found %d of %d keys\n", found, n);
+    }
+
+    bptree_destroy();
+    free(keys);
+}
+
+// Memory footprint and random lookup throughput of the compiled node layout
+static void bench_layout(int n) {
+    int queries = 4000000;
+    double start, elapsed, value_bytes = 0;
+    STATS stats;
+    DATA *vals, *data;
+    int *keys, *probe;
+    int i, found = 0;
+
+    if (!(keys = (int *)malloc(sizeof(int) * n))) ERR;
+    if (!(probe = (int *)malloc(sizeof(int) * queries))) ERR;
+    if (!(vals = (DATA *)malloc(sizeof(DATA) * n))) ERR;
+    make_keys(keys, n, "random");
+    for (i = 0; i < n; i++) {
+        vals[i].value = i;
+    }
+
+#ifdef BPTREE_COMPACT_REFS
+    printf("layout: n=%d N=%d refs=compact sizeof(NODE)=%zu\n", n, N, sizeof(NODE));
+#else
+    printf("layout: n=%d N=%d refs=pointer sizeof(NODE)=%zu\n", n, N, sizeof(NODE));
+#endif
+
+    bptree_init();
+    start = now_sec();
+    for (i = 0; i < n; i++) {
+        bptree_insert(keys[i], &vals[keys[i]]);
+    }
+    elapsed = now_sec() - start;
+    bptree_stats(&stats);
+#ifdef BPTREE_COMPACT_REFS
+    // Values are copied into the tree's own arena
+    value_bytes = (double)g_data_arena.live_slots * sizeof(DATA);
+#endif
+    printf("%-14s %10.2f Mops/s\n", "insert", n / elapsed / 1e6);
+    printf("%-14s %10.1f\n", "node bytes/key", (double)stats.bytes / stats.num_keys);
+    printf("%-14s %10.1f\n", "value bytes/key", value_bytes / stats.num_keys);
+
+    for (i = 0; i < queries; i++) {
+        probe[i] = (int)(next_rand() % (unsigned long long)n);
+    }
+    start = now_sec();
+    for (i = 0; i < queries; i++) {
+        if (bptree_get(probe[i], &data) && data->value == probe[i]) {
+            found++;
+        }
+    }
+    elapsed = now_sec() - start;
+    printf("%-14s %10.2f Mops/s\n", "lookup", queries / elapsed / 1e6);
+
+    if (found != queries) {
+        fprintf(stderr, "layout: found %d of %d keys\n", found, queries);
+    }
+
+    bptree_destroy();
+    free(vals);
+    free(probe);
+    free(keys);
+}
+
+// Push a file out of the page cache so the next read comes from disk
+static long long drop_cache(const char *path) {
+    long long size;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0) ERR;
+    fsync(fd);
+    size = lseek(fd, 0, SEEK_END);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+    return size;
+}
+
+// Restart cost: replaying inserts versus bptree_save/bptree_load of a snapshot
+static void bench_load(int n) {
+    const char *names[] = {"raw", "compressed"};
+    double start, save_time, load_time;
+    long long size;
+    DATA *vals;
+    int *keys;
+    int c, i;
+
+    if (!(keys = (int *)malloc(sizeof(int) * n))) ERR;
+    if (!(vals = (DATA *)malloc(sizeof(DATA) * n))) ERR;
+    make_keys(keys, n, "random");
+    for (i = 0; i < n; i++) {
+        vals[i].value = keys[i];
+    }
+
+    printf("load: n=%d N=%d\n", n, N);
+    printf("%-12s %10s %10s %10s %10s %10s\n", "restart", "MB", "save s", "load s", "MB/s", "Mkeys/s");
+
+    bptree_init();
+    start = now_sec();
+    for (i = 0; i < n; i++) {
+        bptree_insert(keys[i], &vals[i]);
+    }
+    load_time = now_sec() - start;
+    printf("%-12s %10s %10s %10.3f %10s %10.2f\n", "insert", "-", "-", load_time, "-", n / load_time / 1e6);
+
+    for (c = 0; c < 2; c++) {
+        start = now_sec();
+        if (bptree_save(SNAPSHOT_PATH, c) != 0) ERR;
+        save_time = now_sec() - start;
+        size = drop_cache(SNAPSHOT_PATH);
+
+        // A restarted process starts from an empty tree
+        bptree_destroy();
+
+        start = now_sec();
+        if (bptree_load(SNAPSHOT_PATH, 4) != 0) ERR;
+        load_time = now_sec() - start;
+
+        printf("%-12s %10.1f %10.3f %10.3f %10.1f %10.2f\n", names[c], size / 1e6, save_time, load_time,
+               size / load_time / 1e6, n / load_time / 1e6);
+    }
+
+    bptree_destroy();
+    unlink(SNAPSHOT_PATH);
+    free(vals);
+    free(keys);
+}
+
+// Removing a contiguous key range: bptree_delete per key vs bptree_delete_range
+static void bench_delrange(int n) {
+    int sizes[] = {1000, 10000, 100000, 1000000, 10000000};
+    double start, per_key, ranged;
+    int *keys;
+    int s, i, lo, size;
+
+    if (!(keys = (int *)malloc(sizeof(int) * n))) ERR;
+    make_keys(keys, n, "random");
+
+    printf("delrange: n=%d N=%d\n", n, N);
+    printf("%10s %12s %12s %10s\n", "keys", "delete s", "range s", "speedup");
+
+    for (s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])) && sizes[s] <= n; s++) {
+        size = sizes[s];
+        lo = (n - size) / 2;
+
+        // Same tree for both: rebuilt from scratch before each measurement
+        bptree_bulk_load(keys, NULL, n, 1);
+        start = now_sec();
+        for (i = lo; i < lo + size; i++) {
+            bptree_delete(i);
+        }
+        per_key = now_sec() - start;
+        bptree_destroy();
+
+        bptree_bulk_load(keys, NULL, n, 1);
+        start = now_sec();
+        bptree_delete_range(lo, lo + size - 1);
+        ranged = now_sec() - start;
+        bptree_destroy();
+
+        printf("%10d %12.6f %12.6f %10.1f\n", size, per_key, ranged, per_key / ranged);
+    }
+
+    free(keys);
+}
+
+// Anonymous memory currently backed by transparent huge pages, in kB
+static long long anon_huge_kb(void) {
+    char line[128];
+    long long kb = 0;
+    FILE *fp;
+
+    if (!(fp = fopen("/proc/self/smaps_rollup", "r"))) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "AnonHugePages: %lld kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(fp);
+    return kb;
+}
+
+// Random lookups on a tree past the TLB reach, nodes from calloc vs huge-page regions
+static void bench_hugepage(int n) {
+    const char *names[] = {"heap", "hugepage"};
+    int backends[] = {NODE_MEMORY_HEAP, NODE_MEMORY_HUGEPAGE};
+    int queries = 4000000;
+    double start, insert_time, lookup_time;
+    DATA *vals, *data;
+    int *keys, *probe;
+    STATS stats;
+    int b, i, found;
+
+    if (!(keys = (int *)malloc(sizeof(int) * n))) ERR;
+    if (!(probe = (int *)malloc(sizeof(int) * queries))) ERR;
+    if (!(vals = (DATA *)malloc(sizeof(DATA) * n))) ERR;
+    make_keys(keys, n, "random");
+    for (i = 0; i < n; i++) {
+        vals[i].value = i;
+    }
+    for (i = 0; i < queries; i++) {
+        probe[i] = (int)(next_rand() % (unsigned long long)n);
+    }
+
+    printf("hugepage: n=%d N=%d\n", n, N);
+    printf("%-10s %10s %10s %10s %8s %8s %8s %12s\n", "backend", "node MB", "insert", "lookup", "regions",
+           "hugetlb", "thp", "AnonHuge kB");
+
+    for (b = 0; b < 2; b++) {
+        if (bptree_set_node_memory(backends[b], -1) != 0) ERR;
+
+        start = now_sec();
+        for (i = 0; i < n; i++) {
+            bptree_insert(keys[i], &vals[keys[i]]);
+        }
+        insert_time = now_sec() - start;
+
+        found = 0;
+        start = now_sec();
+        for (i = 0; i < queries; i++) {
+            if (bptree_get(probe[i], &data) && data->value == probe[i]) {
+                found++;
+            }
+        }
+        lookup_time = now_sec() - start;
+
+        bptree_stats(&stats);
+        printf("%-10s %10.1f %8.2f M %8.2f M %8lld %8lld %8lld %12lld\n", names[b], stats.bytes / 1e6,
+               n / insert_time / 1e6, queries / lookup_time / 1e6, g_node_pool.regions, g_node_pool.hugetlb_regions,
+               g_node_pool.thp_regions, anon_huge_kb());
+        if (found != queries) {
+            fprintf(stderr, "hugepage: found %d of %d keys\n", found, queries);
+        }
+        bptree_destroy();
+    }
+
+    bptree_set_node_memory(NODE_MEMORY_HEAP, -1);
+    free(vals);
+    free(probe);
+    free(keys);
+}
+
+// Random insert, lookup and delete throughput; build with and without -DBPTREE_BEPSILON to compare
+static void bench_bepsilon(int n) {
+    double start, insert_time, lookup_time, flush_time, delete_time;
+    DATA *vals, *data;
+    int *keys;
+    STATS stats;
+    long long pending;
+    int i, found = 0;
+
+    if (!(keys = (int *)malloc(sizeof(int) * n))) ERR;
+    if (!(vals = (DATA *)malloc(sizeof(DATA) * n))) ERR;
+    make_keys(keys, n, "random");
+    for (i = 0; i < n; i++) {
+        vals[i].value = i;
+    }
+
+#ifdef BPTREE_BEPSILON
+    printf("bepsilon: n=%d N=%d buffer=%d\n", n, N, BEPS_BUFFER);
+#else
+    printf("bepsilon: n=%d N=%d buffer=off\n", n, N);
+#endif
+
+    bptree_init();
+    start = now_sec();
+    for (i = 0; i < n; i++) {
+        bptree_insert(keys[i], &vals[keys[i]]);
+    }
+    insert_time = now_sec() - start;
+
+    // Lookups run with whatever the inserts left pending
+    bptree_stats(&stats);
+    pending = stats.pending_msgs;
+    shuffle(keys, n);
+    start = now_sec();
+    for (i = 0; i < n; i++) {
+        if (bptree_get(keys[i], &data) && data->value == keys[i]) {
+            found++;
+        }
+    }
+    lookup_time = now_sec() - start;
+
+    start = now_sec();
+    bptree_flush();
+    flush_time = now_sec() - start;
+
+    shuffle(keys, n);
+    start = now_sec();
+    for (i = 0; i < n; i++) {
+        bptree_delete(keys[i]);
+    }
+    bptree_flush();
+    delete_time = now_sec() - start;
+
+    printf("%-8s %10s\n", "op", "Mops/s");
+    printf("%-8s %10.2f\n", "insert", n / insert_time / 1e6);
+    printf("%-8s %10.2f\n", "lookup", n / lookup_time / 1e6);
+    printf("%-8s %10.2f\n", "delete", n / delete_time / 1e6);
+    printf("pending after inserts: %lld, flush: %.4f s\n", pending, flush_time);
+    if (found != n) {
+        fprintf(stderr, "bepsilon: found %d of %d keys\n", found, n);
+    }
+
+    bptree_destroy();
+    free(vals);
+    free(keys);
+}
+
+// Random lookups at 0%, 50% and 90% misses, without and with the membership filter
+static void bench_filter(int n) {
+    int miss_rates[] = {0, 50, 90};
+    int queries = 4000000;
+    double start, elapsed[2], del_elapsed[2];
+    long long negatives;
+    int *keys, *probe;
+    STATS stats;
+    int m, f, i, found[2];
+
+    if (!(keys = (int *)malloc(sizeof(int) * n))) ERR;
+    if (!(probe = (int *)malloc(sizeof(int) * queries))) ERR;
+
+    // Even keys are stored, odd keys in between are the misses
+    for (i = 0; i < n; i++) {
+        keys[i] = 2 * i;
+    }
+    bptree_bulk_load(keys, NULL, n, 1);
+
+    printf("filter: n=%d N=%d counters/key=%d\n", n, N, FILTER_COUNTERS_PER_KEY);
+    printf("%6s %12s %12s %8s %10s\n", "miss%", "off Mops/s", "on Mops/s", "speedup", "false pos");
+
+    for (m = 0; m < (int)(sizeof(miss_rates) / sizeof(miss_rates[0])); m++) {
+        for (i = 0; i < queries; i++) {
+            probe[i] = 2 * (int)(next_rand() % (unsigned long long)n);
+            if ((int)(next_rand() % 100) < miss_rates[m]) {
+                probe[i]++;
+            }
+        }
+
+        negatives = 0;
+        for (f = 0; f < 2; f++) {
+            if (f == 1) {
+                bptree_filter_enable(n);
+                bptree_stats_reset();
+            }
+            found[f] = 0;
+            start = now_sec();
+            for (i = 0; i < queries; i++) {
+                found[f] += bptree_get(probe[i], NULL);
+            }
+            elapsed[f] = now_sec() - start;
+            if (f == 1) {
+                bptree_stats(&stats);
+                negatives = stats.counters.filter_negatives;
+                bptree_filter_disable();
+            }
+        }
+
+        printf("%6d %12.2f %12.2f %8.2f", miss_rates[m], queries / elapsed[0] / 1e6, queries / elapsed[1] / 1e6,
+               elapsed[0] / elapsed[1]);
+        if (queries - found[1] > 0) {
+            printf(" %9.2f%%\n", 100.0 * (queries - found[1] - negatives) / (queries - found[1]));
+        } else {
+            printf(" %10s\n", "-");
+        }
+        if (found[0] != found[1]) {
+            fprintf(stderr, "filter: %d hits without the filter, %d with\n", found[0], found[1]);
+        }
+    }
+
+    // Deletes of keys that are not there leave the tree unchanged
+    for (f = 0; f < 2; f++) {
+        if (f == 1) {
+            bptree_filter_enable(n);
+        }
+        start = now_sec();
+        for (i = 0; i < queries; i++) {
+            bptree_delete(2 * (int)(next_rand() % (unsigned long long)n) + 1);
+        }
+        del_elapsed[f] = now_sec() - start;
+    }
+    printf("%6s %12.2f %12.2f %8.2f\n", "delete", queries / del_elapsed[0] / 1e6, queries / del_elapsed[1] / 1e6,
+           del_elapsed[0] / del_elapsed[1]);
+
+    bptree_filter_disable();
+    bptree_destroy();
+    free(probe);
+    free(keys);
+}
+
+// Random lookups and a read-mostly mix, without and with the search layer
+static void bench_layer(int n) {
+    int queries = 2000000, trials = 3;
+    double start, elapsed, get_time[2] = {0, 0}, mget_time[2] = {0, 0}, mix_time[2];
+    DATA *out[16];
+    int *keys, *probe;
+    long long rebuilds;
+    int l, t, i, j, found;
+
+    if (!(keys = (int *)malloc(sizeof(int) * n))) ERR;
+    if (!(probe = (int *)malloc(sizeof(int) * queries))) ERR;
+
+    // Even keys are loaded, odd keys are inserted by the mix
+    for (i = 0; i < n; i++) {
+        keys[i] = 2 * i;
+    }
+    for (i = 0; i < queries; i++) {
+        probe[i] = 2 * (int)(next_rand() % (unsigned long long)n);
+    }
+    bptree_bulk_load(keys, NULL, n, 1);
+    bptree_layer_enable(0);
+    printf("layer: n=%d N=%d budget=%d bytes depth=%d fences=%d\n", n, N, LAYER_BYTES, g_layer.depth,
+           g_layer.num_fences);
+
+    // Off and on alternate, the best of each is kept
+    for (t = 0; t < trials; t++) {
+        for (l = 0; l < 2; l++) {
+            if (l == 1) {
+                bptree_layer_enable(0);
+            }
+            found = 0;
+            start = now_sec();
+            for (i = 0; i < queries; i++) {
+                found += bptree_get(probe[i], NULL);
+            }
+            elapsed = now_sec() - start;
+            if (get_time[l] == 0 || elapsed < get_time[l]) {
+                get_time[l] = elapsed;
+            }
+
+            start = now_sec();
+            for (i = 0; i < queries; i += 16) {
+                bptree_multi_get(probe + i, 16, out);
+            }
+            elapsed = now_sec() - start;
+            if (mget_time[l] == 0 || elapsed < mget_time[l]) {
+                mget_time[l] = elapsed;
+            }
+            bptree_layer_disable();
+
+            if (found != queries) {
+                fprintf(stderr, "layer: found %d of %d keys\n", found, queries);
+            }
+        }
+    }
+
+    // 1 insert of a new key per 100 operations, the rest lookups
+    for (l = 0; l < 2; l++) {
+        if (l == 1) {
+            bptree_layer_enable(0);
+        }
+        start = now_sec();
+        for (i = 0; i < queries; i++) {
+            if (i % 100 == 0) {
+                j = (int)(next_rand() % (unsigned long long)n);
+                bptree_insert(2 * j + 1, NULL);
+            } else {
+                bptree_get(probe[i], NULL);
+            }
+        }
+        mix_time[l] = now_sec() - start;
+    }
+    rebuilds = g_layer.rebuilds - 1;
+    bptree_layer_disable();
+    bptree_destroy();
+
+    printf("%-12s %12s %12s %8s\n", "op", "off Mops/s", "on Mops/s", "speedup");
+    printf("%-12s %12.2f %12.2f %8.2f\n", "get", queries / get_time[0] / 1e6, queries / get_time[1] / 1e6,
+           get_time[0] / get_time[1]);
+    printf("%-12s %12.2f %12.2f %8.2f\n", "multi_get 16", queries / mget_time[0] / 1e6, queries / mget_time[1] / 1e6,
+           mget_time[0] / mget_time[1]);
+    printf("%-12s %12.2f %12.2f %8.2f\n", "99% get", queries / mix_time[0] / 1e6, queries / mix_time[1] / 1e6,
+           mix_time[0] / mix_time[1]);
+    printf("rebuilds during the mix: %lld\n", rebuilds);
+
+    free(probe);
+    free(keys);
+}
+
+// Update-heavy mix on a loaded tree: delete+insert against upsert, get+insert against get_or_insert
+static void bench_upsert(int n) {
+    const char *names[] = {"delete+insert", "upsert", "get+insert", "get_or_insert"};
+    int ops = 4000000, new_pct = 10;
+    double start, elapsed;
+    long long structural;
+    DATA update, *data;
+    int *keys, *probe;
+    STATS stats;
+    long count[4];
+    int v, i;
+
+    if (!(keys = (int *)malloc(sizeof(int) * n))) ERR;
+    if (!(probe = (int *)malloc(sizeof(int) * ops))) ERR;
+
+    // Even keys are loaded, odd keys are new to the tree
+    for (i = 0; i < n; i++) {
+        keys[i] = 2 * i;
+    }
+    for (i = 0; i < ops; i++) {
+        probe[i] = 2 * (int)(next_rand() % (unsigned long long)n);
+        if ((int)(next_rand() % 100) < new_pct) {
+            probe[i]++;
+        }
+    }
+    update.value = 0;
+
+    printf("upsert: n=%d N=%d ops=%d new keys=%d%%\n", n, N, ops, new_pct);
+    printf("%-14s %10s %22s\n", "op", "Mops/s", "splits+merges+borrows");
+
+    for (v = 0; v < 4; v++) {
+        bptree_bulk_load(keys, NULL, n, 1);
+        bptree_stats_reset();
+
+        start = now_sec();
+        for (i = 0; i < ops; i++) {
+            if (v == 0) {
+                bptree_delete(probe[i]);
+                bptree_insert(probe[i], &update);
+            } else if (v == 1) {
+                bptree_upsert(probe[i], &update);
+            } else if (v == 2) {
+                if (!bptree_get(probe[i], &data)) {
+                    bptree_insert(probe[i], &update);
+                }
+            } else {
+                bptree_get_or_insert(probe[i], &update, &data);
+            }
+        }
+        bptree_flush();
+        elapsed = now_sec() - start;
+
+        bptree_stats(&stats);
+        structural = stats.counters.leaf_splits + stats.counters.internal_splits + stats.counters.leaf_merges +
+                     stats.counters.internal_merges + stats.counters.leaf_borrows + stats.counters.internal_borrows;
+        printf("%-14s %10.2f %22lld\n", names[v], ops / elapsed / 1e6, structural);
+        count[v] = bptree_verify(g_root, INT_MIN, INT_MAX);
+        bptree_destroy();
+    }
+
+    // Every variant leaves each key in the tree once
+    if (count[0] != count[1] || count[2] != count[3] || count[0] != count[2]) {
+        fprintf(stderr, "upsert: key counts differ: %ld %ld %ld %ld\n", count[0], count[1], count[2], count[3]);
+    }
+
+    free(probe);
+    free(keys);
+}
+
+#ifdef BPTREE_COMPACT_REFS
+// What a reader process sends back when it is done
+typedef struct reader_result {
+    long long found;
+    long long retries;
+} READER_RESULT;
+
+// Reader process: attach, report ready, wait for the start signal, look up random keys
+static void shm_reader(int n, int queries, int id, int ready_fd, int go_fd, int out_fd) {
+    SHM_READER reader;
+    READER_RESULT result;
+    DATA data;
+    char c = 0;
+    int i, key;
+
+    if (bptree_shm_open(&reader, SHM_NAME) != 0) {
+        perror("bptree_shm_open");
+        _exit(1);
+    }
+    rng_state += (unsigned long long)id * 0x9E3779B97F4A7C15ULL;
+    result.found = 0;
+    if (write(ready_fd, &c, 1) != 1 || read(go_fd, &c, 1) < 0) {
+        _exit(1);
+    }
+
+    for (i = 0; i < queries; i++) {
+        key = (int)(next_rand() % (unsigned long long)n);
+        if (bptree_shm_get(&reader, key, &data) && data.value == key) {
+            result.found++;
+        }
+    }
+    result.retries = reader.retries;
+    if (write(out_fd, &result, sizeof(result)) != (ssize_t)sizeof(result)) {
+        _exit(1);
+    }
+    bptree_shm_close(&reader);
+    _exit(0);
+}
+
+// Aggregate lookup throughput of 1 to 16 reader processes sharing one tree, with and without a writer
+static void bench_shm(int n) {
+    int readers[] = {1, 2, 4, 8, 16};
+    int queries = 1000000;
+    int ready[2], go[2], out[2];
+    READER_RESULT result;
+    DATA *vals, **ptrs, *data;
+    double start, elapsed;
+    long long found, retries, writes;
+    int *keys;
+    int r, w, i, done;
+    char c;
+
+    if (!(keys = (int *)malloc(sizeof(int) * n))) ERR;
+    if (!(vals = (DATA *)malloc(sizeof(DATA) * n))) ERR;
+    if (!(ptrs = (DATA **)malloc(sizeof(DATA *) * n))) ERR;
+    make_keys(keys, n, "random");
+    for (i = 0; i < n; i++) {
+        vals[i].value = i;
+        ptrs[i] = &vals[keys[i]];
+    }
+
+    if (bptree_shm_create(SHM_NAME) != 0) {
+        perror("bptree_shm_create");
+        exit(1);
+    }
+    bptree_shm_write_begin();
+    bptree_bulk_load(keys, ptrs, n, 1);
+    bptree_shm_write_end();
+
+    printf("shm: n=%d N=%d lookups/reader=%d\n", n, N, queries);
+
+    // Reference: the writer's own lookups through bptree_get
+    found = 0;
+    start = now_sec();
+    for (i = 0; i < queries; i++) {
+        if (bptree_get(keys[i % n], &data) && data->value == keys[i % n]) {
+            found++;
+        }
+    }
+    elapsed = now_sec() - start;
+    printf("bptree_get in the writer: %.2f Mops/s\n", queries / elapsed / 1e6);
+    if (found != queries) {
+        fprintf(stderr, "shm: writer found %lld of %d keys\n", found, queries);
+    }
+
+    printf("%8s %7s %12s %12s %10s %12s\n", "readers", "writer", "total Mops/s", "per reader", "retries",
+           "writes/s");
+    for (w = 0; w < 2; w++) {
+        for (r = 0; r < (int)(sizeof(readers) / sizeof(readers[0])); r++) {
+            if (pipe(ready) != 0 || pipe(go) != 0 || pipe(out) != 0) ERR;
+            fflush(stdout);
+            for (i = 0; i < readers[r]; i++) {
+                if (fork() == 0) {
+                    close(go[1]);
+                    shm_reader(n, queries, i, ready[1], go[0], out[1]);
+                }
+            }
+            close(ready[1]);
+            close(go[0]);
+            close(out[1]);
+            for (i = 0; i < readers[r]; i++) {
+                if (read(ready[0], &c, 1) != 1) ERR;
+            }
+
+            // Closing the pipe wakes every reader at once
+            start = now_sec();
+            close(go[1]);
+            writes = 0;
+            done = 0;
+            while (done < readers[r]) {
+                if (w == 0) {
+                    if (wait(NULL) > 0) {
+                        done++;
+                    }
+                    continue;
+                }
+                // Keys past n come and go, so every lookup still hits
+                bptree_shm_write_begin();
+                bptree_insert(n + (int)(writes % 1024), NULL);
+                bptree_delete(n + (int)(writes % 1024));
+                bptree_shm_write_end();
+                writes++;
+                while (waitpid(-1, NULL, WNOHANG) > 0) {
+                    done++;
+                }
+            }
+            elapsed = now_sec() - start;
+
+            found = 0;
+            retries = 0;
+            for (i = 0; i < readers[r]; i++) {
+                if (read(out[0], &result, sizeof(result)) != (ssize_t)sizeof(result)) ERR;
+                found += result.found;
+                retries += result.retries;
+            }
+            close(out[0]);
+            close(ready[0]);
+
+            printf("%8d %7s %12.2f %12.2f %10lld %12.0f\n", readers[r], w ? "on" : "off",
+                   (double)queries * readers[r] / elapsed / 1e6, (double)queries / elapsed / 1e6, retries,
+                   writes / elapsed);
+            if (found != (long long)queries * readers[r]) {
+                fprintf(stderr, "shm: readers found %lld of %lld keys\n", found, (long long)queries * readers[r]);
+            }
+        }
+    }
+
+    bptree_shm_destroy();
+    free(ptrs);
+    free(vals);
+    free(keys);
+}
+#else
+static void bench_shm(int n) {
+    (void)n;
+    printf("shm: needs the compact layout, make bench OPT=\"-O2 -DN=64 -DBPTREE_COMPACT_REFS\"\n");
+}
+#endif
+
+static void show_usage(void) {
+    printf("Usage: bench_bptree <insert|latency|bulk|pscan|mget|leaf|layout|load|delrange|hugepage|bepsilon|filter|shm|layer|upsert> [num_keys]\n");
+}
+
+int main(int argc, char *argv[]) {
+    int n = DEFAULT_KEYS;
+
+    if (argc < 2) {
+        show_usage();
+        return 1;
+    }
+    if (argc > 2) {
+        n = atoi(argv[2]);
+    }
+
+    if (strcmp(argv[1], "insert") == 0) {
+        bench_insert(n);
+    } else if (strcmp(argv[1], "latency") == 0) {
+        bench_latency(n);
+    } else if (strcmp(argv[1], "bulk") == 0) {
+        bench_bulk(n);
+    } else if (strcmp(argv[1], "pscan") == 0) {
+        bench_pscan(n);
+    } else if (strcmp(argv[1], "mget") == 0) {
+        bench_mget(n);
+    } else if (strcmp(argv[1], "leaf") == 0) {
+        bench_leaf(n);
+    } else if (strcmp(argv[1], "layout") == 0) {
+        bench_layout(n);
+    } else if (strcmp(argv[1], "load") == 0) {
+        bench_load(n);
+    } else if (strcmp(argv[1], "delrange") == 0) {
+        bench_delrange(n);
+    } else if (strcmp(argv[1], "hugepage") == 0) {
+        bench_hugepage(n);
+    } else if (strcmp(argv[1], "bepsilon") == 0) {
+        bench_bepsilon(n);
+    } else if (strcmp(argv[1], "filter") == 0) {
+        bench_filter(n);
+    } else if (strcmp(argv[1], "shm") == 0) {
+        bench_shm(n);
+    } else if (strcmp(argv[1], "layer") == 0) {
+        bench_layer(n);
+    } else if (strcmp(argv[1], "upsert") == 0) {
+        bench_upsert(n);
+    } else {
+        show_usage();
+        return 1;
+    }
+
+    return 0;
+}
@@ -2,7 +2,37 @@
 
 // Global variables definition
 NODE *g_root = NULL;
+NODE *g_rightmost_leaf = NULL;
+int g_seq_inserts = 0;
 
 void bptree_init(void) {
     g_root = NULL;
+    g_rightmost_leaf = NULL;
+    g_seq_inserts = 0;
+    g_layer.version++;
+}
+
+void bptree_destroy(void) {
+#ifdef BPTREE_BEPSILON
+    // Pending messages are dropped with the tree
+    buffer_free_all(g_root);
+#endif
+#ifdef BPTREE_COMPACT_REFS
+    // The tree owns both arenas, so drop them wholesale
+    arena_reset(&g_node_arena);
+    arena_reset(&g_data_arena);
+#else
+    if (g_node_pool.backend == NODE_MEMORY_HUGEPAGE) {
+        // Every node lives in the pool, unmap it instead of walking the tree
+        node_pool_reset();
+    } else {
+        free_tree(g_root);
+    }
+    free(g_loaded_data);
+    g_loaded_data = NULL;
+#endif
+    bptree_init();
+    if (g_filter.enabled) {
+        filter_clear();
+    }
 }
\ No newline at end of file
@@ -3,35 +3,361 @@
 
 #include <stddef.h>
 #include <math.h>
+#include <pthread.h>
 
 #include "debug.h"
 
+#ifndef N
 #define N 4 // Maximum number of children per node
+#endif
+
+// Consecutive appends at the right edge before the tree switches to sequential mode
+#ifndef SEQ_THRESHOLD
+#define SEQ_THRESHOLD 8
+#endif
+
+// Fraction of entries kept in the left node when splitting in sequential mode
+#define SEQ_SPLIT_RATIO 0.9
+
+// Upper bound on worker threads used by parallel operations
+#define MAX_BULK_THREADS 64
+
+// Structural statistics limits
+#define MAX_LEVELS 32
+#define FILL_BUCKETS 10
+
+// Leaf entries are appended unsorted and found by fingerprint (-DBPTREE_UNSORTED_LEAVES)
+#ifdef BPTREE_UNSORTED_LEAVES
+#define SET_FINGERPRINT(leaf, i) ((leaf)->fp[i] = key_fingerprint((leaf)->key[i]))
+#else
+#define SET_FINGERPRINT(leaf, i) ((void)0)
+#endif
+
+// Hot-path counters, compiled out with -DBPTREE_NO_STATS
+#ifndef BPTREE_NO_STATS
+#define STAT_INC(name) (g_counters.name++)
+#else
+#define STAT_INC(name) ((void)0)
+#endif
+
+// Operation trace hook, compiled out with -DBPTREE_NO_TRACE
+#ifndef BPTREE_NO_TRACE
+#define TRACE_OP(op, key, arg) (g_trace.active ? trace_record(op, key, arg) : (void)0)
+#else
+#define TRACE_OP(op, key, arg) ((void)0)
+#endif
+
+// Bytes of trace records gathered in memory between writes
+#define TRACE_BUFFER (1 << 16)
+
+// Membership filter hooks, no-ops unless bptree_filter_enable was called
+#define FILTER_ADD(key) (g_filter.enabled ? filter_add(key) : (void)0)
+#define FILTER_REMOVE(key) (g_filter.enabled ? filter_remove(key) : (void)0)
+#define FILTER_MISS(key) (g_filter.enabled && !filter_may_contain(key))
+
+// Search layer hooks, no-ops unless bptree_layer_enable was called
+#define LAYER_START(key) (g_layer.enabled ? layer_find(key) : g_root)
+#define LAYER_TOUCH(node) (g_layer.enabled ? layer_touch(node) : (void)0)
+
+// One-byte counters per expected key in the membership filter (about 2% false positives)
+#ifndef FILTER_COUNTERS_PER_KEY
+#define FILTER_COUNTERS_PER_KEY 10
+#endif
+#define FILTER_BLOCK 64             // counters per block (one cache line), indexed with 6 hash bits
+#define FILTER_HASHES 4             // counters set per key
+
+// Default size of the search layer, meant to stay in L2
+#ifndef LAYER_BYTES
+#define LAYER_BYTES (1 << 18)
+#endif
+
+// Bytes of address space reserved per arena (-DBPTREE_COMPACT_REFS)
+#ifndef ARENA_RESERVE
+#define ARENA_RESERVE (1ULL << 40)
+#endif
+
+// Bytes in front of the arenas of a shared-memory tree, a multiple of the page size
+#define SHM_HEADER_SIZE 4096
+
+// Bytes per region of the huge-page node pool, a multiple of the 2 MB huge page
+#ifndef NODE_REGION_SIZE
+#define NODE_REGION_SIZE (1 << 24)
+#endif
+
+// Pending messages an internal node holds before flushing a batch down (-DBPTREE_BEPSILON).
+// Larger buffers speed up inserts and slow down lookups, see the table in README.md.
+#ifndef BEPS_BUFFER
+#define BEPS_BUFFER (8 * N)
+#endif
+
+// Node memory backends (bptree_set_node_memory)
+#define NODE_MEMORY_HEAP 0          // calloc per node
+#define NODE_MEMORY_HUGEPAGE 1      // nodes carved from huge-page regions
+
+// Operations recorded in a trace (bptree_trace_start)
+#define TRACE_INSERT 0
+#define TRACE_DELETE 1
+#define TRACE_GET 2
+#define TRACE_RANGE 3               // range scans and aggregates, arg is the end key
+#define TRACE_DELRANGE 4            // bptree_delete_range, arg is the end key
+#define TRACE_UPSERT 5
+#define TRACE_INSERT_UNIQUE 6
+#define TRACE_GET_OR_INSERT 7
+#define TRACE_SPLIT 8               // bptree_split, key is the split key
+#define TRACE_JOIN 9                // bptree_join, key is the smallest key of the joined tree
+#define TRACE_OPS 10                // at most 16, a record keeps the op in 4 bits
 
 // Data structure to hold the actual data
 typedef struct data {
     int value;
 } DATA;
 
+// Key-data pair used when building the tree from an array
+typedef struct entry {
+    int key;
+    DATA *data;
+} ENTRY;
+
+// Result of an aggregate over a key range
+typedef struct aggregate {
+    long long count;
+    long long sum;
+    int min;    // valid only when count > 0
+    int max;    // valid only when count > 0
+} AGGREGATE;
+
+// Where nodes come from, and what the OS granted for the regions mapped so far
+typedef struct node_pool {
+    int backend;                // NODE_MEMORY_HEAP or NODE_MEMORY_HUGEPAGE
+    int numa_node;              // NUMA node the regions are bound to, -1 for none
+    char *region;               // region nodes are carved from, links to the previous one
+    size_t region_used;
+    void *free_list;            // freed nodes, linked through their first bytes
+    long long regions;
+    long long hugetlb_regions;  // backed by reserved huge pages (MAP_HUGETLB)
+    long long thp_regions;      // transparent huge pages requested (MADV_HUGEPAGE)
+    long long numa_regions;     // bound to numa_node
+    pthread_mutex_t lock;
+} NODE_POOL;
+
+#ifdef BPTREE_COMPACT_REFS
+// Fixed-size slot allocator over one reserved address range
+typedef struct arena {
+    char *base;                 // slot i lives at base + i * slot_size
+    size_t slot_size;
+    unsigned int max_slots;
+    unsigned int next_slot;     // first never-used slot, slot 0 is never handed out
+    unsigned int free_list;     // most recently freed slot, 0 if none
+    long long live_slots;
+    pthread_mutex_t lock;
+} ARENA;
+
+// Nodes and leaf values are 32-bit slot indices, 0 stands for NULL
+typedef unsigned int NODE_REF;
+#define NULL_REF 0
+#define NODE_AT(ref) ((NODE *)(g_node_arena.base + (size_t)(ref) * sizeof(NODE)))
+#define NODE_PTR(ref) ((ref) ? NODE_AT(ref) : NULL)
+#define NODE_REF_OF(node) ((node) ? (NODE_REF)(((char *)(node) - g_node_arena.base) / sizeof(NODE)) : NULL_REF)
+#define DATA_PTR(ref) ((ref) ? (DATA *)(g_data_arena.base + (size_t)(ref) * sizeof(DATA)) : NULL)
+#else
+typedef struct node *NODE_REF;
+#define NULL_REF NULL
+#define NODE_AT(ref) (ref)
+#define NODE_PTR(ref) (ref)
+#define NODE_REF_OF(node) (node)
+#define DATA_PTR(ref) ((DATA *)(ref))
+#endif
+
+// Node field accessors, valid in both layouts
+#define CHILD(node, i) NODE_PTR((node)->child[i])
+#define SET_CHILD(node, i, c) ((node)->child[i] = NODE_REF_OF(c))
+#define PARENT(node) NODE_PTR((node)->parent)
+#define SET_PARENT(node, p) ((node)->parent = NODE_REF_OF(p))
+#define NEXT_LEAF(leaf) CHILD(leaf, N - 1)
+#define SET_NEXT_LEAF(leaf, next) SET_CHILD(leaf, N - 1, next)
+#define LEAF_DATA(leaf, i) DATA_PTR((leaf)->child[i])
+
+#ifdef BPTREE_BEPSILON
+// Buffered operation waiting in an internal node, applied when it reaches a leaf
+#define MSG_INSERT 0
+#define MSG_DELETE 1
+#define MSG_UPSERT 2                // insert, or replace the value if the key is there
+
+typedef struct message {
+    int key;
+    int op;                     // MSG_INSERT, MSG_DELETE or MSG_UPSERT
+    NODE_REF value;             // leaf value for MSG_INSERT and MSG_UPSERT
+} MESSAGE;
+#endif
+
 // B+tree node structure
 typedef struct node {
     int num_keys;
+#ifdef BPTREE_UNSORTED_LEAVES
+    unsigned char fp[N - 1];    // 1-byte hash of each leaf key, checked before the key
+#endif
     int key[N - 1];
-    struct node *child[N];
-    struct node *parent;
+    NODE_REF child[N];          // leaves: values in child[0..N-2], next leaf in child[N-1]
+    NODE_REF parent;
     int is_leaf; // 1 if leaf, 0 if internal node
+#ifdef BPTREE_BEPSILON
+    // Internal nodes only: pending messages sorted by key, oldest first among equal keys
+    MESSAGE *buffer;
+    int num_msgs;
+    int buffer_cap;
+#endif
 } NODE;
 
 // Temporary structure for node splitting
 typedef struct temp {
     int num_keys;
     int key[N];
-    struct node *child[N + 1];
+    NODE_REF child[N + 1];
     int is_leaf; // 1 if leaf, 0 if internal node
 } TEMP;
 
+// Event counters updated on the insert/delete paths
+typedef struct counters {
+    long long inserts;
+    long long append_inserts;   // inserts that took the rightmost-leaf fast path
+    long long updates;          // values replaced in place by bptree_upsert
+    long long deletes;          // entries removed, deletes of missing keys are not counted
+    long long leaf_splits;
+    long long internal_splits;
+    long long root_splits;
+    long long leaf_merges;
+    long long internal_merges;
+    long long leaf_borrows;
+    long long internal_borrows;
+    long long root_shrinks;
+    long long buffered_msgs;    // operations parked in the root buffer (-DBPTREE_BEPSILON)
+    long long buffer_flushes;   // batches moved one level down
+    long long filter_negatives; // lookups and deletes answered by the membership filter
+} COUNTERS;
+
+// Structural statistics gathered by walking the tree
+typedef struct stats {
+    int height;
+    long long num_keys;
+    long long num_nodes;
+    long long num_leaves;
+    long long num_children;     // child pointers of internal nodes
+    long long nodes_per_level[MAX_LEVELS];
+    long long leaf_fill_histogram[FILL_BUCKETS];
+    double leaf_fill;           // keys / leaf capacity
+    double internal_fill;       // children / internal capacity
+    long long bytes;            // memory held by nodes and their buffers
+    long long pending_msgs;     // messages not yet applied to leaves
+    COUNTERS counters;
+} STATS;
+
+// State of the trace being recorded
+typedef struct trace {
+    int active;                 // checked by TRACE_OP on every operation
+    int fd;
+    int error;                  // errno of the first failed write, 0 if none
+    unsigned long long sample_cut;  // record when the top 32 random bits are below this
+    unsigned long long rng;
+    unsigned long long last_ns; // clock of the previous record
+    int last_key;
+    size_t used;                // bytes waiting in buffer
+    unsigned char *buffer;
+    long long seen;             // operations offered to the trace
+    long long recorded;
+} TRACE;
+
+// Counting Bloom filter over the keys of the tree (bptree_filter_enable)
+typedef struct filter {
+    int enabled;
+    int stale;                  // counts are wrong, rebuild before the next use
+    unsigned char *counts;      // num_blocks cache-line blocks of counters
+    unsigned long long num_blocks;  // power of two
+    long long num_keys;         // keys counted in
+    long long capacity;         // keys the table is sized for
+} FILTER;
+
+// Separator keys of the levels above one internal level, in Eytzinger order (bptree_layer_enable)
+typedef struct search_layer {
+    int enabled;
+    size_t max_bytes;
+    unsigned long long version;         // bumped when a node above depth changes
+    unsigned long long built_version;   // version the arrays were built from
+    long long stale_lookups;    // lookups that found the layer out of date since it was built
+    int depth;                  // level the search lands on, 0 to start at the root
+    int num_fences;             // one less than the nodes at depth
+    int *keys;                  // keys[1..num_fences], children of k at 2k and 2k+1
+    NODE **nodes;               // nodes[k]: node for keys below keys[k] and above its predecessor
+    NODE *last;                 // node for keys at or above every fence
+    long long rebuilds;
+} SEARCH_LAYER;
+
+// One operation read back from a trace
+typedef struct trace_record {
+    int op;
+    int key;
+    int arg;                    // end key of range operations
+    unsigned long long time_ns; // since the trace was started
+} TRACE_RECORD;
+
+// Sequential reader of a trace file
+typedef struct trace_reader {
+    int fd;
+    int eof;
+    double sample_rate;         // as given to bptree_trace_start
+    size_t pos, len;
+    unsigned char *buffer;
+    unsigned long long time_ns;
+    int last_key;
+} TRACE_READER;
+
+#ifdef BPTREE_COMPACT_REFS
+// Start of a shared-memory segment, followed by the node arena and the data arena
+typedef struct shm_header {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int order;         // N of the writer
+    unsigned int node_size;     // sizeof(NODE) of the writer
+    unsigned int data_size;     // sizeof(DATA) of the writer
+    NODE_REF root;              // published by bptree_shm_write_end
+    unsigned int node_slots;    // node slots below this index have been handed out
+    unsigned int data_slots;
+    unsigned long long seq;     // seqlock, odd while the writer is inside a write section
+} SHM_HEADER;
+
+// Writer side of the shared-memory tree (bptree_shm_create)
+typedef struct shm {
+    char *base;                 // whole segment, NULL while the tree is private
+    size_t size;
+    int fd;
+    SHM_HEADER *header;
+    char name[256];
+} SHM;
+
+// Read-only view of a tree shared by another process
+typedef struct shm_reader {
+    const SHM_HEADER *header;
+    const char *nodes;          // slot i of the writer's node arena is at nodes + i * sizeof(NODE)
+    const char *data;
+    size_t size;
+    long long retries;          // reads repeated because the writer changed the tree meanwhile
+} SHM_READER;
+#endif
+
 // Global variables
 extern NODE *g_root;
+extern NODE *g_rightmost_leaf;  // Hint for the append fast path
+extern int g_seq_inserts;       // Consecutive inserts that landed in g_rightmost_leaf
+extern COUNTERS g_counters;
+extern DATA *g_loaded_data;     // Data read by bptree_load, owned by the tree
+extern NODE_POOL g_node_pool;   // Node memory backend
+extern TRACE g_trace;           // Operation trace, inactive unless started
+extern FILTER g_filter;         // Membership filter, disabled unless enabled
+extern SEARCH_LAYER g_layer;    // Search layer over the upper levels, disabled unless enabled
+#ifdef BPTREE_COMPACT_REFS
+extern ARENA g_node_arena;      // Every NODE of the tree
+extern ARENA g_data_arena;      // Copies of the DATA stored in leaves
+extern SHM g_shm;               // Shared-memory segment holding both arenas, if any
+#endif
 
 // ====================
 // Initialization
@@ -42,6 +368,14 @@ extern NODE *g_root;
  */
 void bptree_init(void);
 
+/**
+ * @brief Free every node of the B+tree and reset it to empty
+ * @note Data pointers stored in leaves are not freed, except data read by
+ *       bptree_load (with compact refs the tree owns its copies of the data
+ *       and releases them)
+ */
+void bptree_destroy(void);
+
 // ====================
 // Memory management
 // ====================
@@ -66,6 +400,73 @@ TEMP *alloc_temp(NODE *node);
  */
 void clear_node(NODE *node);
 
+/**
+ * @brief Release a single node
+ * @param node Node to free
+ */
+void free_node(NODE *node);
+
+/**
+ * @brief Recursively free a node and all of its descendants
+ * @param node Root of the subtree to free (NULL is allowed)
+ */
+void free_tree(NODE *node);
+
+/**
+ * @brief Turn a data pointer into the value stored in a leaf slot
+ * @param data Data to store (may be NULL)
+ * @return Leaf value; with compact refs, a reference to a tree-owned copy of *data
+ */
+NODE_REF alloc_data(DATA *data);
+
+/**
+ * @brief Release a leaf value obtained from alloc_data
+ * @param value Leaf value (no-op unless BPTREE_COMPACT_REFS)
+ */
+void free_data(NODE_REF value);
+
+#ifdef BPTREE_COMPACT_REFS
+/**
+ * @brief Hand out a zeroed slot, reserving the address range on first use
+ * @param arena Arena to allocate from
+ * @return Slot index (never 0)
+ */
+NODE_REF arena_alloc(ARENA *arena);
+
+/**
+ * @brief Return a slot to the arena
+ * @param arena Arena the slot came from
+ * @param ref Slot index
+ */
+void arena_free(ARENA *arena, NODE_REF ref);
+
+/**
+ * @brief Drop every slot and give the memory back to the OS
+ * @param arena Arena to reset (keeps its address range)
+ */
+void arena_reset(ARENA *arena);
+#endif
+
+/**
+ * @brief Choose where nodes are allocated
+ * @param backend NODE_MEMORY_HEAP or NODE_MEMORY_HUGEPAGE
+ * @param numa_node NUMA node to bind node memory to, or -1 for no binding
+ * @return 0 on success, -1 if the tree still holds keys or lives in shared
+ *         memory (bptree_shm_create)
+ *
+ * With NODE_MEMORY_HUGEPAGE nodes are carved out of NODE_REGION_SIZE regions
+ * mapped with MAP_HUGETLB, falling back to MADV_HUGEPAGE when no huge pages
+ * are reserved. With compact refs the node arena itself gets the huge-page
+ * advice. g_node_pool records what each region actually received.
+ */
+int bptree_set_node_memory(int backend, int numa_node);
+
+/**
+ * @brief Unmap every region of the huge-page node pool at once
+ * @note Nodes from the pool, including detached trees, become invalid
+ */
+void node_pool_reset(void);
+
 // ====================
 // Utility
 // ====================
@@ -78,6 +479,18 @@ void clear_node(NODE *node);
  */
 NODE *find_leaf(NODE *node, int key);
 
+/**
+ * @brief Find the leftmost leaf that can hold key
+ * @param node Current node to start search from
+ * @param key Key value to search for
+ * @return Pointer to the leftmost leaf whose range includes key
+ *
+ * Duplicates of a key may straddle a separator equal to it, find_leaf goes
+ * right of such a separator and this goes left. If key is not in the leaf
+ * returned, its first copy is the first key of the next leaf or nowhere.
+ */
+NODE *find_leaf_first(NODE *node, int key);
+
 /**
  * @brief Find a sibling node for merging
  * @param node Parent node containing the child
@@ -95,6 +508,68 @@ NODE *find_sibling_node(NODE *node, NODE *child_node);
  */
 NODE *find_leftmost_leaf(NODE *node);
 
+/**
+ * @brief Find the slot of a key in a leaf
+ * @param leaf Leaf node to search
+ * @param key Key to search for
+ * @return Index of key in leaf, or -1 if absent
+ *
+ * Unsorted leaves compare fingerprints (16 at a time with SSE2) before keys.
+ */
+int leaf_find(NODE *leaf, int key);
+
+/**
+ * @brief Find the first copy of a key from the leaf find_leaf_first returned
+ * @param leaf Leaf from find_leaf_first, moved to the next leaf if the key is there
+ * @param key Key to search for
+ * @return Index of key in *leaf, or -1 if absent
+ */
+int leaf_find_first(NODE **leaf, int key);
+
+/**
+ * @brief Find a key from the leaf find_leaf routed it to
+ * @param leaf Leaf from find_leaf, moved to the leaf holding the key if that differs
+ * @param key Key to search for
+ * @return Index of key in *leaf, or -1 if absent
+ *
+ * Copies of a key equal to the leaf's lower separator may all sit left of
+ * it. Only when every key of the leaf is above key does this descend again
+ * with find_leaf_first.
+ */
+int leaf_find_routed(NODE **leaf, int key);
+
+/**
+ * @brief Sort leaf entries by key (no-op unless BPTREE_UNSORTED_LEAVES)
+ * @param leaf Leaf node to sort in place
+ *
+ * Call before any code that relies on leaf order (splits, borrows, scans).
+ */
+void leaf_sort(NODE *leaf);
+
+/**
+ * @brief Compute the 1-byte fingerprint stored for a leaf key
+ * @param key Key to hash
+ * @return Fingerprint byte
+ */
+unsigned char key_fingerprint(int key);
+
+/**
+ * @brief Write v as a little-endian base-128 varint
+ * @param p Output position, with room for 10 bytes
+ * @param v Value to write
+ * @return Position after the last byte written
+ */
+unsigned char *put_varint(unsigned char *p, unsigned long long v);
+
+/**
+ * @brief Read a varint written by put_varint
+ * @param p Input position
+ * @param end End of the input
+ * @param v Receives the value
+ * @return Position after the varint, NULL if it runs past end or is longer than 10 bytes
+ */
+const unsigned char *get_varint(const unsigned char *p, const unsigned char *end, unsigned long long *v);
+
 /**
  * @brief Find parent key between child and sibling for merge/redistribution
  * @param parent_node Parent node
@@ -104,6 +579,30 @@ NODE *find_leftmost_leaf(NODE *node);
  */
 int find_parent_key(NODE *parent_node, NODE *child_node, NODE *sibling_node);
 
+// ====================
+// Search
+// ====================
+
+/**
+ * @brief Look up a single key
+ * @param key Key to search for
+ * @param data Receives the associated data if found (may be NULL)
+ * @return 1 if key exists, 0 otherwise
+ */
+int bptree_get(int key, DATA **data);
+
+/**
+ * @brief Look up a batch of keys with interleaved, prefetched descents
+ * @param keys Keys to search for
+ * @param count Number of keys
+ * @param out Receives the data of each key (NULL if absent)
+ * @return Number of keys found
+ *
+ * Lookups advance one level at a time in groups, and each one prefetches its
+ * next node before it is touched, so the cache misses of the group overlap.
+ */
+int bptree_multi_get(const int *keys, int count, DATA **out);
+
 // ====================
 // Insert
 // ====================
@@ -116,22 +615,68 @@ int find_parent_key(NODE *parent_node, NODE *child_node, NODE *sibling_node);
 void bptree_insert(int key, DATA *data);
 
 /**
- * @brief Insert key-data into leaf node (space must be available)
- * @param leaf Target leaf node
+ * @brief Insert key-data pair in a single root-to-leaf pass
+ * @param key Key to insert
+ * @param data Associated data
+ *
+ * Full internal nodes are split preemptively during the descent, so the
+ * split never cascades back up the tree. With an odd N a full node cannot be
+ * halved without underfilling one half, so this falls back to bptree_insert.
+ */
+void bptree_insert_topdown(int key, DATA *data);
+
+/**
+ * @brief Insert key-data pair, or replace the data if key is already there
+ * @param key Key to insert or update
+ * @param data Associated data
+ *
+ * One descent finds the leaf; an existing key only has its value swapped, so
+ * there is no delete, merge or split. With duplicates the first copy is updated.
+ * Under -DBPTREE_BEPSILON the upsert is buffered and settled at the leaf.
+ */
+void bptree_upsert(int key, DATA *data);
+
+/**
+ * @brief Insert key-data pair unless key is already there
  * @param key Key to insert
  * @param data Associated data
+ * @return 1 if inserted, 0 if key exists (the tree is unchanged)
+ */
+int bptree_insert_unique(int key, DATA *data);
+
+/**
+ * @brief Look up key and insert key-data pair if it is missing, in one descent
+ * @param key Key to search for
+ * @param data Data to insert if key is missing
+ * @param out Receives the existing data, or the data now stored (may be NULL)
+ * @return 1 if key was already there, 0 if it was inserted
+ */
+int bptree_get_or_insert(int key, DATA *data, DATA **out);
+
+/**
+ * @brief Insert key-value into leaf node (space must be available)
+ * @param leaf Target leaf node
+ * @param key Key to insert
+ * @param value Leaf value from alloc_data
  * @return Modified leaf node
  */
-NODE *insert_in_leaf(NODE *leaf, int key, DATA *data);
+NODE *insert_in_leaf(NODE *leaf, int key, NODE_REF value);
 
 /**
  * @brief Insert key-child into temporary structure during node splitting
  * @param temp Temporary structure to insert into
  * @param key Key to insert
- * @param child_node Child node pointer to insert
+ * @param child_node Child node (or leaf value) to insert
  * @return Modified temporary structure
  */
-TEMP *insert_in_temp(TEMP *temp, int key, NODE *child_node);
+TEMP *insert_in_temp(TEMP *temp, int key, NODE_REF child_node);
+
+/**
+ * @brief Decide how many keys stay in the original node when splitting
+ * @param temp Temporary structure containing all keys
+ * @return Split index (even split, or right-biased in sequential mode)
+ */
+int calc_split_index(TEMP *temp);
 
 /**
  * @brief Split overflowing temporary structure into two nodes
@@ -142,6 +687,22 @@ TEMP *insert_in_temp(TEMP *temp, int key, NODE *child_node);
  */
 int split_temp_to_nodes(NODE *node, NODE *new_node, TEMP *temp);
 
+/**
+ * @brief Split a full leaf, insert key-value and promote the new leaf
+ * @param leaf Full leaf node
+ * @param key Key to insert
+ * @param value Leaf value from alloc_data
+ * @return New right leaf node
+ */
+NODE *split_leaf(NODE *leaf, int key, NODE_REF value);
+
+/**
+ * @brief Split a full internal node in half without a temporary structure
+ * @param node Internal node holding N-1 keys (its parent must have room)
+ * @return New right internal node
+ */
+NODE *split_full_node(NODE *node);
+
 /**
  * @brief Handle parent insertion after node split
  * @param node The node that was split
@@ -160,6 +721,31 @@ NODE *insert_in_parent(NODE *node, int key, NODE *new_node);
  */
 NODE *insert_in_node(NODE *node, int key, NODE *child_node);
 
+// ====================
+// Bulk load
+// ====================
+
+/**
+ * @brief Build the tree from unsorted key-data pairs with multiple threads
+ * @param keys Keys to load (any order)
+ * @param data Data pointers matching keys (NULL to store NULL data)
+ * @param count Number of pairs
+ * @param num_threads Number of worker threads (capped at MAX_BULK_THREADS)
+ *
+ * Input is sample-sorted in parallel, each thread builds a run of leaves and
+ * its share of every internal level, and the runs are stitched together.
+ * Falls back to bptree_insert for each pair if the tree is not empty.
+ */
+void bptree_bulk_load(const int *keys, DATA **data, int count, int num_threads);
+
+/**
+ * @brief Build the tree bottom-up from sorted entries (tree must be empty)
+ * @param entries Entries sorted by key
+ * @param count Number of entries
+ * @param num_threads Number of worker threads
+ */
+void build_from_sorted(ENTRY *entries, int count, int num_threads);
+
 // ====================
 // Delete
 // ====================
@@ -209,6 +795,173 @@ int count_child(NODE *node);
  */
 int check_node_order(NODE *parent_node, NODE *child_node, NODE *sibling_node);
 
+// ====================
+// Split, join and range delete
+// ====================
+
+/**
+ * @brief Delete every key in [start_key, end_key]
+ * @param start_key Start of range (inclusive)
+ * @param end_key End of range (inclusive)
+ *
+ * The range is cut out with two split_tree calls and freed as whole
+ * subtrees. Only the two boundary leaves are trimmed, and the two remaining
+ * parts are joined back together along a single path.
+ */
+void bptree_delete_range(int start_key, int end_key);
+
+/**
+ * @brief Cut a tree into keys < key and keys >= key
+ * @param root Root of the tree to cut (consumed, may be NULL)
+ * @param key Split key
+ * @param left Receives the root of the lower part (NULL if empty)
+ * @param right Receives the root of the upper part (NULL if empty)
+ *
+ * The subtrees hanging off the path to the leftmost leaf that can hold key
+ * are joined back together on each side, so no entry is copied except in the
+ * cut leaf. Copies of key left of an equal separator go to the upper part.
+ */
+void split_tree(NODE *root, int key, NODE **left, NODE **right);
+
+/**
+ * @brief Concatenate two trees whose key ranges do not overlap
+ * @param left Root of the lower tree (consumed, may be NULL)
+ * @param left_height Height of left (a single leaf is 1, NULL is 0)
+ * @param sep Separator key: above every key of left, at most the smallest key of right
+ * @param right Root of the upper tree (consumed, may be NULL)
+ * @param right_height Height of right
+ * @param height Receives the height of the joined tree (may be NULL)
+ * @return Root of the joined tree (NULL if both are empty)
+ *
+ * The shorter tree is grafted onto the spine of the taller one at its own
+ * height, then the seam is fixed by one merge or redistribution. The heights
+ * are passed in so that split_tree, which joins once per level, visits
+ * O(log n) nodes in total.
+ */
+NODE *join_tree(NODE *left, int left_height, int sep, NODE *right, int right_height, int *height);
+
+/**
+ * @brief Smallest key of a non-empty tree
+ * @param root Root of the tree
+ * @return Key in the tree's leftmost leaf slot after sorting it
+ */
+int tree_min_key(NODE *root);
+
+/**
+ * @brief Move every key >= key out of the tree
+ * @param key Split key
+ * @return Root of a detached tree holding the keys >= key (NULL if none)
+ *
+ * The detached tree keeps its leaf data and is handed back to the tree
+ * with bptree_join, or released with free_tree.
+ */
+NODE *bptree_split(int key);
+
+/**
+ * @brief Attach a detached tree whose keys all lie above or below the tree's
+ * @param tree Root of the tree to attach (consumed on success, may be NULL)
+ * @return 0 on success, -1 if the key ranges overlap (tree is left untouched)
+ */
+int bptree_join(NODE *tree);
+
+/**
+ * @brief Check the B+tree invariants of a tree
+ * @param root Root of the tree to check (may be NULL)
+ * @param min_key Smallest key the tree may hold
+ * @param max_key Largest key the tree may hold
+ * @return Number of keys in the tree, or -1 if an invariant is broken
+ *
+ * Checks key order and bounds against the separators, parent links, key
+ * counts, minimum fill, equal leaf depth, and that the leaf chain visits
+ * every leaf in order and ends in NULL. Nodes on the right spine are exempt
+ * from minimum fill, since appends deliberately leave them nearly empty.
+ * Copies of a separator may sit on either side of it, so a bad cut only
+ * shows against the bounds: after bptree_split(k) the lower part must pass
+ * with max_key = k - 1 and the detached part with min_key = k.
+ */
+long bptree_verify(NODE *root, int min_key, int max_key);
+
+// ====================
+// Write buffers (B-epsilon mode)
+// ====================
+
+/**
+ * @brief Apply every pending message to the leaves (no-op without -DBPTREE_BEPSILON)
+ * @note Operations that walk or restructure whole subtrees (parallel scans,
+ *       snapshots, split/join, range delete, top-down insert) flush first
+ */
+void bptree_flush(void);
+
+#ifdef BPTREE_BEPSILON
+/**
+ * @brief Park an operation in the root buffer, flushing batches down when it fills
+ * @param key Key of the operation
+ * @param op MSG_INSERT, MSG_DELETE or MSG_UPSERT
+ * @param value Leaf value for MSG_INSERT and MSG_UPSERT (from alloc_data)
+ *
+ * A full buffer sends the messages bound for its busiest child one level
+ * down, into that child's buffer or, above the leaves, into the leaves.
+ */
+void buffer_message(int key, int op, NODE_REF value);
+
+/**
+ * @brief Point lookup that replays the pending messages on the search path
+ * @param key Key to look up
+ * @param data Receives the data of the newest visible entry (may be NULL)
+ * @return 1 if the key is present, 0 otherwise
+ */
+int buffer_get(int key, DATA **data);
+
+/**
+ * @brief Print keys in [start_key, end_key] merged with pending messages
+ * @param start_key Start of range (inclusive)
+ * @param end_key End of range (inclusive)
+ */
+void buffer_scan_range(int start_key, int end_key);
+
+/**
+ * @brief Move the messages of left that belong at or above sep to right
+ * @param left Internal node that was split
+ * @param right Its new right sibling
+ * @param sep Separator key between them
+ */
+void buffer_split(NODE *left, NODE *right, int sep);
+
+/**
+ * @brief Append the messages of node to its left sibling before node is merged away
+ * @param node Right node being merged
+ * @param sibling_node Left node receiving its children
+ */
+void buffer_merge(NODE *node, NODE *sibling_node);
+
+/**
+ * @brief Repartition the messages of two adjacent siblings after a borrow
+ * @param parent Common parent
+ * @param left Left sibling
+ * @param right Right sibling
+ */
+void buffer_rebalance(NODE *parent, NODE *left, NODE *right);
+
+/**
+ * @brief Hand the messages of a shrinking root to its only child
+ * @param old_root Root being removed
+ * @param child New root
+ */
+void buffer_push_down(NODE *old_root, NODE *child);
+
+/**
+ * @brief Release the buffer of a node that is being freed
+ * @param node Node being freed
+ */
+void buffer_free(NODE *node);
+
+/**
+ * @brief Release every buffer of a tree without applying the messages
+ * @param node Root of the tree (may be NULL)
+ */
+void buffer_free_all(NODE *node);
+#endif
+
 // ====================
 // Scan
 // ====================
@@ -225,6 +978,296 @@ void bptree_scan_all(void);
  */
 void bptree_scan_range(int start_key, int end_key);
 
+/**
+ * @brief Compute count/sum/min/max of keys in a range with multiple threads
+ * @param start_key Start of range (inclusive)
+ * @param end_key End of range (inclusive)
+ * @param num_threads Number of worker threads
+ * @param result Combined aggregate of all sub-ranges
+ *
+ * The range is cut at separator keys of the upper internal levels into
+ * several sub-ranges per thread, which workers pull from a shared queue.
+ */
+void bptree_parallel_aggregate(int start_key, int end_key, int num_threads, AGGREGATE *result);
+
+/**
+ * @brief Collect keys in a range in ascending order with multiple threads
+ * @param start_key Start of range (inclusive)
+ * @param end_key End of range (inclusive)
+ * @param num_threads Number of worker threads
+ * @param keys Output array
+ * @param max_keys Capacity of keys
+ * @return Number of keys written
+ */
+int bptree_parallel_range(int start_key, int end_key, int num_threads, int *keys, int max_keys);
+
+// ====================
+// Snapshot
+// ====================
+
+/**
+ * @brief Write every key and its data to a binary snapshot file
+ * @param path File to create (overwritten if present)
+ * @param compress Nonzero to delta/varint-encode the keys of each block
+ * @return 0 on success, -1 on I/O error (errno is set)
+ *
+ * The leaf chain is streamed in key order as checksummed blocks. The DATA
+ * contents are stored, not the pointers.
+ */
+int bptree_save(const char *path, int compress);
+
+/**
+ * @brief Replace the tree with the contents of a snapshot file
+ * @param path File written by bptree_save
+ * @param num_threads Number of worker threads used to build the tree
+ * @return 0 on success, -1 if the file cannot be read or fails validation
+ *         (the tree is left untouched in that case)
+ *
+ * Blocks are read sequentially and checked against their CRC-32, and keys
+ * must be in ascending order across the whole file. Then the tree is built
+ * bottom-up with build_from_sorted. The loaded data is owned
+ * by the tree and freed by bptree_destroy.
+ */
+int bptree_load(const char *path, int num_threads);
+
+// ====================
+// Trace
+// ====================
+
+/**
+ * @brief Start recording operations to a binary trace file
+ * @param path File to create (overwritten if present)
+ * @param sample_rate Fraction of operations to record, in (0, 1]
+ * @return 0 on success, -1 on error (errno is set, EBUSY if a trace is
+ *         already being recorded)
+ *
+ * Inserts, deletes, lookups, range scans, range deletes, splits and joins are
+ * recorded with their time since the previous record, as varints in a
+ * buffered log. A join names the tree it attaches by its smallest key. Each
+ * operation is sampled independently; only a rate of 1 reproduces the tree.
+ */
+int bptree_trace_start(const char *path, double sample_rate);
+
+/**
+ * @brief Stop recording and close the trace file
+ * @return 0 on success, -1 if a write failed while recording (errno is set)
+ */
+int bptree_trace_stop(void);
+
+/**
+ * @brief Append one operation to the trace (called through TRACE_OP)
+ * @param op Operation (TRACE_INSERT, ...)
+ * @param key Key, or start key of a range
+ * @param arg End key of a range, ignored otherwise
+ */
+void trace_record(int op, int key, int arg);
+
+/**
+ * @brief Open a trace file for reading
+ * @param reader Reader to initialize
+ * @param path File written by bptree_trace_start
+ * @return 0 on success, -1 if the file cannot be read or is not a trace
+ */
+int bptree_trace_open(TRACE_READER *reader, const char *path);
+
+/**
+ * @brief Read the next operation of a trace
+ * @param reader Reader opened with bptree_trace_open
+ * @param record Receives the operation
+ * @return 1 if a record was read, 0 at the end of the trace, -1 if the
+ *         trace is truncated or corrupt
+ */
+int bptree_trace_next(TRACE_READER *reader, TRACE_RECORD *record);
+
+/**
+ * @brief Close a trace reader and release its buffer
+ * @param reader Reader opened with bptree_trace_open
+ */
+void bptree_trace_close(TRACE_READER *reader);
+
+// ====================
+// Membership filter
+// ====================
+
+/**
+ * @brief Enable the membership filter and count in the keys already in the tree
+ * @param expected_keys Keys to size the filter for; it doubles when exceeded
+ *
+ * bptree_get, bptree_multi_get and bptree_delete skip the descent for keys
+ * the filter has never seen. Counters are kept in sync on insert and delete.
+ * Operations that add keys wholesale (bulk load, snapshot load, join) mark
+ * the filter stale, and it is rebuilt from the leaves on its next use.
+ */
+void bptree_filter_enable(long long expected_keys);
+
+/**
+ * @brief Disable the membership filter and release its memory
+ */
+void bptree_filter_disable(void);
+
+/**
+ * @brief Count a key into the filter (called through FILTER_ADD)
+ * @param key Key being inserted
+ */
+void filter_add(int key);
+
+/**
+ * @brief Count a key out of the filter (called through FILTER_REMOVE)
+ * @param key Key removed from a leaf
+ */
+void filter_remove(int key);
+
+/**
+ * @brief Count every key of a detached subtree out of the filter
+ * @param node Root of the subtree
+ */
+void filter_remove_tree(NODE *node);
+
+/**
+ * @brief Reset every counter, for a tree that became empty
+ */
+void filter_clear(void);
+
+/**
+ * @brief Check the filter for a key (called through FILTER_MISS)
+ * @param key Key to look for
+ * @return 0 if the key is certainly absent, 1 if it may be present
+ */
+int filter_may_contain(int key);
+
+// ====================
+// Search layer
+// ====================
+
+/**
+ * @brief Enable the search layer over the upper internal levels
+ * @param max_bytes Size limit of the layer, 0 for LAYER_BYTES
+ *
+ * The separator keys of every level above the deepest internal level that
+ * fits in max_bytes are packed into one array in Eytzinger order. bptree_get
+ * and bptree_multi_get search it without branches and start their descent
+ * at that level. A split, merge or borrow that changes a node above it
+ * bumps the layer's version. Lookups then start at the root until as many
+ * of them as the layer has fences have gone by, and the next one rebuilds
+ * it, so constant restructuring cannot make rebuilds dominate. Lookups that
+ * go through the B-epsilon buffers do not use it.
+ */
+void bptree_layer_enable(size_t max_bytes);
+
+/**
+ * @brief Disable the search layer and release its memory
+ */
+void bptree_layer_disable(void);
+
+/**
+ * @brief Find the node at the layer's depth whose subtree holds key
+ *        (called through LAYER_START)
+ * @param key Key to look for
+ * @return Node to continue the descent from; the root if the layer is empty
+ */
+NODE *layer_find(int key);
+
+/**
+ * @brief Note that the keys or children of an internal node change
+ *        (called through LAYER_TOUCH)
+ * @param node Node being changed, NULL when the root is replaced
+ */
+void layer_touch(NODE *node);
+
+#ifdef BPTREE_COMPACT_REFS
+// ====================
+// Shared memory
+// ====================
+
+/**
+ * @brief Move the (empty) tree into a POSIX shared-memory segment
+ * @param name Segment name for shm_open, e.g. "/bptree"
+ * @return 0 on success, -1 on error (errno is set, EBUSY if the tree holds
+ *         keys or is already shared)
+ *
+ * Both arenas are mapped from the segment, so child and value references are
+ * slot indices that mean the same in every process. The calling process is
+ * the only writer; other processes attach with bptree_shm_open.
+ */
+int bptree_shm_create(const char *name);
+
+/**
+ * @brief Unmap and unlink the segment; the tree is emptied and becomes private
+ * @return 0 on success, -1 if shm_unlink failed (errno is set)
+ */
+int bptree_shm_destroy(void);
+
+/**
+ * @brief Enter a write section; readers retry until it ends
+ * @note Every change to a shared tree has to happen inside a write section.
+ *       Several operations may share one section.
+ */
+void bptree_shm_write_begin(void);
+
+/**
+ * @brief Publish the root and slot counts, then leave the write section
+ * @note With BPTREE_BEPSILON the buffers are flushed first, since readers
+ *       only look at the leaves
+ */
+void bptree_shm_write_end(void);
+
+/**
+ * @brief Map a shared tree read-only
+ * @param reader Reader to initialize
+ * @param name Segment name given to bptree_shm_create
+ * @return 0 on success, -1 on error (errno is set, EINVAL if the segment was
+ *         created with a different N or node layout)
+ */
+int bptree_shm_open(SHM_READER *reader, const char *name);
+
+/**
+ * @brief Unmap a shared tree
+ * @param reader Reader opened with bptree_shm_open
+ */
+void bptree_shm_close(SHM_READER *reader);
+
+/**
+ * @brief Look up a key in a shared tree
+ * @param reader Reader opened with bptree_shm_open
+ * @param key Key to look up
+ * @param data Receives a copy of the value, zeroed for keys stored without
+ *             data (may be NULL)
+ * @return 1 if found, 0 otherwise
+ */
+int bptree_shm_get(SHM_READER *reader, int key, DATA *data);
+
+/**
+ * @brief Compute count/sum/min/max of keys in a range of a shared tree
+ * @param reader Reader opened with bptree_shm_open
+ * @param start_key Start of range (inclusive)
+ * @param end_key End of range (inclusive)
+ * @param result Aggregate of the keys in the range
+ */
+void bptree_shm_aggregate(SHM_READER *reader, int start_key, int end_key, AGGREGATE *result);
+#endif
+
+// ====================
+// Statistics
+// ====================
+
+/**
+ * @brief Walk the tree once and snapshot structure and counters
+ * @param stats Receives height, node counts per level, fill histogram,
+ *              memory use and the current event counters
+ */
+void bptree_stats(STATS *stats);
+
+/**
+ * @brief Reset the event counters to zero
+ */
+void bptree_stats_reset(void);
+
+/**
+ * @brief Print statistics in human readable form
+ * @param stats Statistics filled by bptree_stats
+ */
+void bptree_stats_print(STATS *stats);
+
 // ====================
 // Debug
 // ====================
@@ -0,0 +1,522 @@
+#include <string.h>
+#include <limits.h>
+
+#include "bptree.h"
+
+#ifdef BPTREE_BEPSILON
+
+// A pending message tagged with where it was found, for whole-tree passes.
+// Deeper messages are older, so (key, depth desc, order) is the apply order.
+typedef struct pending {
+    MESSAGE msg;
+    int depth;
+    int order;
+} PENDING;
+
+typedef struct pending_list {
+    PENDING *items;
+    int count;
+    int capacity;
+} PENDING_LIST;
+
+// Internal nodes freed so far, a flush stops as soon as this moves because
+// the nodes it was working on may be gone
+static unsigned long g_internal_frees = 0;
+
+// Messages of a root that shrank to a leaf, applied after the current flush
+static MESSAGE *g_deferred = NULL;
+static int g_num_deferred = 0;
+static int g_deferred_cap = 0;
+
+static void reserve_messages(MESSAGE **buffer, int *capacity, int count) {
+    int new_cap;
+
+    if (count <= *capacity) {
+        return;
+    }
+    new_cap = *capacity > 0 ? *capacity : BEPS_BUFFER;
+    while (new_cap < count) {
+        new_cap *= 2;
+    }
+    if (!(*buffer = (MESSAGE *)realloc(*buffer, sizeof(MESSAGE) * new_cap))) ERR;
+    *capacity = new_cap;
+}
+
+// Index of the first message with a key >= key
+static int lower_bound(NODE *node, int key) {
+    int lo = 0, hi = node->num_msgs, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (node->buffer[mid].key < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Index of the first message with a key > key
+static int upper_bound(NODE *node, int key) {
+    int lo = 0, hi = node->num_msgs, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (node->buffer[mid].key <= key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Merge sorted msgs into the buffer of node; they are newer, so they go
+// after messages with the same key
+static void merge_messages(NODE *node, const MESSAGE *msgs, int count) {
+    int i, j, k;
+
+    if (count == 0) {
+        return;
+    }
+    reserve_messages(&node->buffer, &node->buffer_cap, node->num_msgs + count);
+
+    if (count == 1) {
+        // A new message at the root: one block move instead of an element-wise merge
+        i = upper_bound(node, msgs[0].key);
+        memmove(node->buffer + i + 1, node->buffer + i, sizeof(MESSAGE) * (node->num_msgs - i));
+        node->buffer[i] = msgs[0];
+        node->num_msgs++;
+        return;
+    }
+
+    i = node->num_msgs - 1;
+    j = count - 1;
+    for (k = node->num_msgs + count - 1; j >= 0; k--) {
+        if (i >= 0 && node->buffer[i].key > msgs[j].key) {
+            node->buffer[k] = node->buffer[i--];
+        } else {
+            node->buffer[k] = msgs[j--];
+        }
+    }
+    node->num_msgs += count;
+}
+
+// Apply one message at the leaf level; buffers on the way down only hold
+// newer messages or messages for other keys, so they can be skipped.
+// leaf is the target if the caller knows it, NULL to search from the root.
+// Returns 0 once a split or an underflow may have moved keys to other leaves.
+static int apply_message(NODE *leaf, const MESSAGE *msg) {
+    int i, underflow;
+
+    if (leaf == NULL) {
+        leaf = find_leaf(g_root, msg->key);
+    }
+    if (msg->op == MSG_UPSERT) {
+        i = leaf_find_routed(&leaf, msg->key);
+        if (i >= 0) {
+            // The filter counted key when the upsert was buffered
+            free_data(leaf->child[i]);
+            leaf->child[i] = msg->value;
+            FILTER_REMOVE(msg->key);
+            STAT_INC(updates);
+            return 1;
+        }
+        STAT_INC(inserts);
+    }
+    if (msg->op != MSG_DELETE) {
+        if (leaf->num_keys < N - 1) {
+            insert_in_leaf(leaf, msg->key, msg->value);
+            return 1;
+        }
+        split_leaf(leaf, msg->key, msg->value);
+        return 0;
+    }
+
+    // Deleting a key that is not there is a no-op
+    i = leaf_find_routed(&leaf, msg->key);
+    if (i < 0) {
+        return 1;
+    }
+    underflow = leaf->num_keys - 1 < (int)ceil((N - 1) / 2.0);
+    free_data(leaf->child[i]);
+    FILTER_REMOVE(msg->key);
+    delete_entry(leaf, msg->key, NULL);
+    STAT_INC(deletes);
+    return !underflow;
+}
+
+static void apply_deferred(void) {
+    MESSAGE *msgs;
+    int i, count;
+
+    while (g_num_deferred > 0) {
+        msgs = g_deferred;
+        count = g_num_deferred;
+        g_deferred = NULL;
+        g_num_deferred = 0;
+        g_deferred_cap = 0;
+
+        for (i = 0; i < count; i++) {
+            apply_message(NULL, &msgs[i]);
+        }
+        free(msgs);
+    }
+}
+
+static void flush_node(NODE *node);
+
+// Send the messages bound for the busiest child of node one level down
+static void flush_child(NODE *node) {
+    MESSAGE *batch;
+    NODE *child, *leaf;
+    int i, j = 0, lo = 0, best = 0, best_lo = 0, best_hi = 0, count;
+
+    // The buffer is sorted, so each child's messages form one run
+    for (i = 0; i <= node->num_keys; i++) {
+        while (j < node->num_msgs && (i == node->num_keys || node->buffer[j].key < node->key[i])) {
+            j++;
+        }
+        if (j - lo > best_hi - best_lo) {
+            best = i;
+            best_lo = lo;
+            best_hi = j;
+        }
+        lo = j;
+    }
+
+    count = best_hi - best_lo;
+    child = CHILD(node, best);
+    STAT_INC(buffer_flushes);
+
+    if (child->is_leaf == 0) {
+        merge_messages(child, node->buffer + best_lo, count);
+        memmove(node->buffer + best_lo, node->buffer + best_hi, sizeof(MESSAGE) * (node->num_msgs - best_hi));
+        node->num_msgs -= count;
+        if (child->num_msgs >= BEPS_BUFFER) {
+            flush_node(child);
+        }
+        return;
+    }
+
+    // Leaf splits and merges may repartition this buffer, so take a copy first
+    if (!(batch = (MESSAGE *)malloc(sizeof(MESSAGE) * count))) ERR;
+    memcpy(batch, node->buffer + best_lo, sizeof(MESSAGE) * count);
+    memmove(node->buffer + best_lo, node->buffer + best_hi, sizeof(MESSAGE) * (node->num_msgs - best_hi));
+    node->num_msgs -= count;
+
+    // The whole run belongs to child until the first split or merge
+    leaf = child;
+    for (i = 0; i < count; i++) {
+        if (!apply_message(leaf, &batch[i])) {
+            leaf = NULL;
+        }
+    }
+    free(batch);
+}
+
+static void flush_node(NODE *node) {
+    unsigned long frees = g_internal_frees;
+
+    // Drain to half full so the next flush of this node is a while away
+    do {
+        flush_child(node);
+    } while (frees == g_internal_frees && node->num_msgs > BEPS_BUFFER / 2);
+}
+
+void buffer_message(int key, int op, NODE_REF value) {
+    MESSAGE msg;
+
+    msg.key = key;
+    msg.op = op;
+    msg.value = value;
+
+    // Messages are applied out of order with other keys, appends are not sequential
+    g_seq_inserts = 0;
+    STAT_INC(buffered_msgs);
+
+    merge_messages(g_root, &msg, 1);
+    if (g_root->num_msgs >= BEPS_BUFFER) {
+        flush_node(g_root);
+        apply_deferred();
+    }
+}
+
+int buffer_get(int key, DATA **data) {
+    NODE *path[MAX_LEVELS];
+    NODE *node = g_root;
+    NODE_REF value = NULL_REF;
+    int depth = 0, straddle = 0, count, i, kid;
+
+    while (node->is_leaf == 0) {
+        // Only levels holding messages are probed again on the way back
+        if (node->num_msgs > 0) {
+            path[depth++] = node;
+        }
+        for (kid = 0; kid < node->num_keys; kid++) {
+            if (key < node->key[kid]) {
+                break;
+            }
+        }
+        straddle |= kid > 0 && node->key[kid - 1] == key;
+        node = NODE_AT(node->child[kid]);
+    }
+
+    // Messages follow find_leaf, but copies of a key equal to a separator on
+    // the way may sit left of it
+    i = leaf_find(node, key);
+    if (i < 0 && straddle) {
+        node = find_leaf_first(g_root, key);
+        i = leaf_find_first(&node, key);
+    }
+    count = i >= 0;
+    if (i >= 0) {
+        value = node->child[i];
+    }
+
+    // Replay pending messages from the oldest (deepest) to the newest, the
+    // buffers are sorted so each level is one binary search
+    while (depth-- > 0) {
+        node = path[depth];
+        for (i = lower_bound(node, key); i < node->num_msgs && node->buffer[i].key == key; i++) {
+            if (node->buffer[i].op == MSG_INSERT) {
+                count++;
+                value = node->buffer[i].value;
+            } else if (node->buffer[i].op == MSG_UPSERT) {
+                count = count > 0 ? count : 1;
+                value = node->buffer[i].value;
+            } else if (count > 0) {
+                count--;
+            }
+        }
+    }
+
+    if (count == 0) {
+        return 0;
+    }
+    if (data != NULL) {
+        *data = DATA_PTR(value);
+    }
+    return 1;
+}
+
+static void add_pending(PENDING_LIST *list, const MESSAGE *msg, int depth) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity > 0 ? list->capacity * 2 : BEPS_BUFFER;
+        if (!(list->items = (PENDING *)realloc(list->items, sizeof(PENDING) * list->capacity))) ERR;
+    }
+    list->items[list->count].msg = *msg;
+    list->items[list->count].depth = depth;
+    list->items[list->count].order = list->count;
+    list->count++;
+}
+
+// Gather the messages for keys in [start_key, end_key] from every internal
+// node whose key range [lo, hi] overlaps it
+static void collect_pending(NODE *node, long long lo, long long hi, int start_key, int end_key,
+                            int depth, PENDING_LIST *list) {
+    long long child_lo, child_hi;
+    int i;
+
+    if (node->is_leaf == 1 || hi < start_key || lo > end_key) {
+        return;
+    }
+
+    for (i = lower_bound(node, start_key); i < node->num_msgs && node->buffer[i].key <= end_key; i++) {
+        add_pending(list, &node->buffer[i], depth);
+    }
+    for (i = 0; i <= node->num_keys; i++) {
+        child_lo = i > 0 ? node->key[i - 1] : lo;
+        child_hi = i < node->num_keys ? (long long)node->key[i] - 1 : hi;
+        collect_pending(CHILD(node, i), child_lo, child_hi, start_key, end_key, depth + 1, list);
+    }
+}
+
+static int compare_pending(const void *a, const void *b) {
+    const PENDING *x = (const PENDING *)a, *y = (const PENDING *)b;
+
+    if (x->msg.key != y->msg.key) {
+        return x->msg.key < y->msg.key ? -1 : 1;
+    }
+    if (x->depth != y->depth) {
+        return y->depth - x->depth;
+    }
+    return x->order - y->order;
+}
+
+// Next leaf key in [start_key, end_key], in order; returns 0 at the end
+static int next_leaf_key(NODE **leaf, int *i, int start_key, int end_key, int *key) {
+    while (*leaf != NULL) {
+        if (*i == 0) {
+            leaf_sort(*leaf);
+        }
+        while (*i < (*leaf)->num_keys) {
+            *key = (*leaf)->key[(*i)++];
+            if (*key > end_key) {
+                *leaf = NULL;
+                return 0;
+            }
+            if (*key >= start_key) {
+                return 1;
+            }
+        }
+        *leaf = NEXT_LEAF(*leaf);
+        *i = 0;
+    }
+    return 0;
+}
+
+void buffer_scan_range(int start_key, int end_key) {
+    PENDING_LIST list = {NULL, 0, 0};
+    NODE *leaf;
+    int i = 0, m = 0, have, leaf_key = 0, key, count, c;
+
+    collect_pending(g_root, INT_MIN, INT_MAX, start_key, end_key, 0, &list);
+    if (list.count > 1) {
+        qsort(list.items, list.count, sizeof(PENDING), compare_pending);
+    }
+
+    leaf = find_leftmost_leaf(g_root);
+    have = next_leaf_key(&leaf, &i, start_key, end_key, &leaf_key);
+
+    printf("RESULT: ");
+
+    // Merge the leaf keys with the pending messages, one key at a time
+    while (have || m < list.count) {
+        key = have && (m == list.count || leaf_key <= list.items[m].msg.key) ? leaf_key : list.items[m].msg.key;
+
+        count = 0;
+        while (have && leaf_key == key) {
+            count++;
+            have = next_leaf_key(&leaf, &i, start_key, end_key, &leaf_key);
+        }
+        for (; m < list.count && list.items[m].msg.key == key; m++) {
+            if (list.items[m].msg.op == MSG_INSERT) {
+                count++;
+            } else if (list.items[m].msg.op == MSG_UPSERT) {
+                count = count > 0 ? count : 1;
+            } else if (count > 0) {
+                count--;
+            }
+        }
+
+        for (c = 0; c < count; c++) {
+            printf("%d ", key);
+        }
+    }
+
+    printf("\n");
+    free(list.items);
+}
+
+void buffer_split(NODE *left, NODE *right, int sep) {
+    int i = lower_bound(left, sep);
+
+    merge_messages(right, left->buffer + i, left->num_msgs - i);
+    left->num_msgs = i;
+}
+
+void buffer_merge(NODE *node, NODE *sibling_node) {
+    merge_messages(sibling_node, node->buffer, node->num_msgs);
+    node->num_msgs = 0;
+}
+
+void buffer_rebalance(NODE *parent, NODE *left, NODE *right) {
+    int i, sep;
+
+    for (i = 0; i < parent->num_keys; i++) {
+        if (CHILD(parent, i) == left) {
+            break;
+        }
+    }
+    sep = parent->key[i];
+
+    // Children moved one way, so only one side can hold misplaced messages
+    buffer_split(left, right, sep);
+    i = lower_bound(right, sep);
+    if (i > 0) {
+        merge_messages(left, right->buffer, i);
+        memmove(right->buffer, right->buffer + i, sizeof(MESSAGE) * (right->num_msgs - i));
+        right->num_msgs -= i;
+    }
+}
+
+void buffer_push_down(NODE *old_root, NODE *child) {
+    if (child->is_leaf == 0) {
+        merge_messages(child, old_root->buffer, old_root->num_msgs);
+    } else if (old_root->num_msgs > 0) {
+        reserve_messages(&g_deferred, &g_deferred_cap, g_num_deferred + old_root->num_msgs);
+        memcpy(g_deferred + g_num_deferred, old_root->buffer, sizeof(MESSAGE) * old_root->num_msgs);
+        g_num_deferred += old_root->num_msgs;
+    }
+    old_root->num_msgs = 0;
+}
+
+void buffer_free(NODE *node) {
+    if (node->is_leaf == 0) {
+        g_internal_frees++;
+    }
+    free(node->buffer);
+    node->buffer = NULL;
+    node->num_msgs = 0;
+    node->buffer_cap = 0;
+}
+
+void buffer_free_all(NODE *node) {
+    int i;
+
+    if (node == NULL || node->is_leaf == 1) {
+        return;
+    }
+    for (i = 0; i <= node->num_keys; i++) {
+        buffer_free_all(CHILD(node, i));
+    }
+    free(node->buffer);
+    node->buffer = NULL;
+    node->num_msgs = 0;
+    node->buffer_cap = 0;
+}
+
+// Move every message of the subtree into list and empty the buffers
+static void take_all_pending(NODE *node, int depth, PENDING_LIST *list) {
+    int i;
+
+    if (node->is_leaf == 1) {
+        return;
+    }
+    for (i = 0; i < node->num_msgs; i++) {
+        add_pending(list, &node->buffer[i], depth);
+    }
+    free(node->buffer);
+    node->buffer = NULL;
+    node->num_msgs = 0;
+    node->buffer_cap = 0;
+
+    for (i = 0; i <= node->num_keys; i++) {
+        take_all_pending(CHILD(node, i), depth + 1, list);
+    }
+}
+#endif
+
+void bptree_flush(void) {
+#ifdef BPTREE_BEPSILON
+    PENDING_LIST list = {NULL, 0, 0};
+    int i;
+
+    if (g_root == NULL || g_root->is_leaf == 1) {
+        return;
+    }
+
+    // With every buffer empty, messages can go straight to the leaves in key order
+    take_all_pending(g_root, 0, &list);
+    if (list.count > 1) {
+        qsort(list.items, list.count, sizeof(PENDING), compare_pending);
+    }
+    for (i = 0; i < list.count; i++) {
+        apply_message(NULL, &list.items[i].msg);
+    }
+    free(list.items);
+    apply_deferred();
+#endif
+}
\ No newline at end of file
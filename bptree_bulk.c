@@ -0,0 +1,357 @@
+#include <pthread.h>
+#include <string.h>
+
+#include "bptree.h"
+
+#define SAMPLES_PER_THREAD 64
+
+// Shared state of one bulk build, every worker sees the same context
+typedef struct bulk_ctx {
+    const int *keys;
+    DATA **data;
+    int count;
+    int num_threads;
+    int *splitters;     // num_threads - 1 bucket boundaries
+    int *bucket_count;  // [thread][bucket] counts, then write offsets
+    int *bucket_start;  // num_threads + 1 bucket offsets into entries
+    ENTRY *entries;     // entries grouped by bucket, then sorted
+    NODE **nodes;       // nodes of the level being built
+    int *mins;          // smallest key in each subtree of nodes
+    int num_nodes;
+    NODE **parents;     // nodes of the level above
+    int *parent_mins;
+    int num_parents;
+} BULK_CTX;
+
+typedef struct bulk_task {
+    BULK_CTX *ctx;
+    int id;
+} BULK_TASK;
+
+#define RADIX_BITS 11
+#define RADIX_SIZE (1 << RADIX_BITS)
+
+static int compare_int(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+// Index of the bucket holding key (number of splitters <= key)
+static int find_bucket(BULK_CTX *ctx, int key) {
+    int lo = 0, hi = ctx->num_threads - 1, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (key < ctx->splitters[mid]) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    return lo;
+}
+
+// Start of the i-th of parts evenly sized pieces of total
+static int part_start(int total, int parts, int i) {
+    return i * (total / parts) + (i < total % parts ? i : total % parts);
+}
+
+static void run_parallel(BULK_CTX *ctx, void *(*fn)(void *)) {
+    pthread_t threads[MAX_BULK_THREADS];
+    BULK_TASK tasks[MAX_BULK_THREADS];
+    int t;
+
+    for (t = 0; t < ctx->num_threads; t++) {
+        tasks[t].ctx = ctx;
+        tasks[t].id = t;
+        if (t > 0 && pthread_create(&threads[t], NULL, fn, &tasks[t]) != 0) ERR;
+    }
+
+    // Calling thread takes the first share of the work
+    fn(&tasks[0]);
+
+    for (t = 1; t < ctx->num_threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+}
+
+static void *count_buckets(void *arg) {
+    BULK_TASK *task = (BULK_TASK *)arg;
+    BULK_CTX *ctx = task->ctx;
+    int *count = ctx->bucket_count + task->id * ctx->num_threads;
+    int i, end = part_start(ctx->count, ctx->num_threads, task->id + 1);
+
+    for (i = part_start(ctx->count, ctx->num_threads, task->id); i < end; i++) {
+        count[find_bucket(ctx, ctx->keys[i])]++;
+    }
+
+    return NULL;
+}
+
+static void *scatter_buckets(void *arg) {
+    BULK_TASK *task = (BULK_TASK *)arg;
+    BULK_CTX *ctx = task->ctx;
+    int *offset = ctx->bucket_count + task->id * ctx->num_threads;
+    int i, pos, end = part_start(ctx->count, ctx->num_threads, task->id + 1);
+
+    for (i = part_start(ctx->count, ctx->num_threads, task->id); i < end; i++) {
+        pos = offset[find_bucket(ctx, ctx->keys[i])]++;
+        ctx->entries[pos].key = ctx->keys[i];
+        ctx->entries[pos].data = ctx->data ? ctx->data[i] : NULL;
+    }
+
+    return NULL;
+}
+
+// LSD radix sort on the key, three passes of RADIX_BITS bits
+static void radix_sort(ENTRY *entries, int count) {
+    ENTRY *buffer, *src = entries, *dst, *swap;
+    int *histogram;
+    int pass, i, sum, n;
+    unsigned int digit;
+
+    if (!(buffer = (ENTRY *)malloc(sizeof(ENTRY) * (count > 0 ? count : 1)))) ERR;
+    if (!(histogram = (int *)malloc(sizeof(int) * RADIX_SIZE))) ERR;
+    dst = buffer;
+
+    for (pass = 0; pass * RADIX_BITS < 32; pass++) {
+        memset(histogram, 0, sizeof(int) * RADIX_SIZE);
+        for (i = 0; i < count; i++) {
+            // Flip the sign bit so negative keys sort first
+            digit = (((unsigned int)src[i].key ^ 0x80000000u) >> (pass * RADIX_BITS)) & (RADIX_SIZE - 1);
+            histogram[digit]++;
+        }
+        for (i = 0, sum = 0; i < RADIX_SIZE; i++) {
+            n = histogram[i];
+            histogram[i] = sum;
+            sum += n;
+        }
+        for (i = 0; i < count; i++) {
+            digit = (((unsigned int)src[i].key ^ 0x80000000u) >> (pass * RADIX_BITS)) & (RADIX_SIZE - 1);
+            dst[histogram[digit]++] = src[i];
+        }
+        swap = src;
+        src = dst;
+        dst = swap;
+    }
+
+    // Odd number of passes leaves the result in the buffer
+    if (src != entries) {
+        memcpy(entries, src, sizeof(ENTRY) * count);
+    }
+
+    free(histogram);
+    free(buffer);
+}
+
+static void *sort_bucket(void *arg) {
+    BULK_TASK *task = (BULK_TASK *)arg;
+    BULK_CTX *ctx = task->ctx;
+    int start = ctx->bucket_start[task->id];
+
+    radix_sort(ctx->entries + start, ctx->bucket_start[task->id + 1] - start);
+
+    return NULL;
+}
+
+static void *build_leaves(void *arg) {
+    BULK_TASK *task = (BULK_TASK *)arg;
+    BULK_CTX *ctx = task->ctx;
+    int first = part_start(ctx->num_nodes, ctx->num_threads, task->id);
+    int last = part_start(ctx->num_nodes, ctx->num_threads, task->id + 1);
+    int i, j, start, end;
+    NODE *leaf;
+
+    // Build one run of consecutive leaves, linked to each other
+    for (j = first; j < last; j++) {
+        start = part_start(ctx->count, ctx->num_nodes, j);
+        end = part_start(ctx->count, ctx->num_nodes, j + 1);
+
+        leaf = alloc_leaf(NULL);
+        for (i = start; i < end; i++) {
+            leaf->key[leaf->num_keys] = ctx->entries[i].key;
+            leaf->child[leaf->num_keys] = alloc_data(ctx->entries[i].data);
+            SET_FINGERPRINT(leaf, leaf->num_keys);
+            leaf->num_keys++;
+        }
+        if (j > first) {
+            SET_NEXT_LEAF(ctx->nodes[j - 1], leaf);
+        }
+
+        ctx->nodes[j] = leaf;
+        ctx->mins[j] = leaf->key[0];
+    }
+
+    return NULL;
+}
+
+static void *build_parents(void *arg) {
+    BULK_TASK *task = (BULK_TASK *)arg;
+    BULK_CTX *ctx = task->ctx;
+    int first = part_start(ctx->num_parents, ctx->num_threads, task->id);
+    int last = part_start(ctx->num_parents, ctx->num_threads, task->id + 1);
+    int i, j, start, end;
+    NODE *parent;
+
+    for (j = first; j < last; j++) {
+        start = part_start(ctx->num_nodes, ctx->num_parents, j);
+        end = part_start(ctx->num_nodes, ctx->num_parents, j + 1);
+
+        parent = alloc_leaf(NULL);
+        parent->is_leaf = 0;
+        for (i = start; i < end; i++) {
+            if (i > start) {
+                parent->key[parent->num_keys++] = ctx->mins[i];
+            }
+            SET_CHILD(parent, i - start, ctx->nodes[i]);
+            SET_PARENT(ctx->nodes[i], parent);
+        }
+
+        ctx->parents[j] = parent;
+        ctx->parent_mins[j] = ctx->mins[start];
+    }
+
+    return NULL;
+}
+
+// Pick bucket boundaries from a sample of the input
+static void choose_splitters(BULK_CTX *ctx) {
+    int samples = ctx->num_threads * SAMPLES_PER_THREAD;
+    int *sample;
+    unsigned int seed = 12345;
+    int i;
+
+    if (!(sample = (int *)malloc(sizeof(int) * samples))) ERR;
+    for (i = 0; i < samples; i++) {
+        seed = seed * 1103515245 + 12345;
+        sample[i] = ctx->keys[seed % (unsigned int)ctx->count];
+    }
+    qsort(sample, samples, sizeof(int), compare_int);
+
+    for (i = 1; i < ctx->num_threads; i++) {
+        ctx->splitters[i - 1] = sample[i * SAMPLES_PER_THREAD];
+    }
+
+    free(sample);
+}
+
+void build_from_sorted(ENTRY *entries, int count, int num_threads) {
+    BULK_CTX ctx;
+    NODE **level;
+    int *level_mins;
+    int j;
+
+    if (count == 0) {
+        return;
+    }
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.entries = entries;
+    ctx.count = count;
+
+    // Even distribution keeps every node at least half full
+    ctx.num_nodes = (count + N - 2) / (N - 1);
+    if (!(ctx.nodes = (NODE **)malloc(sizeof(NODE *) * ctx.num_nodes))) ERR;
+    if (!(ctx.mins = (int *)malloc(sizeof(int) * ctx.num_nodes))) ERR;
+
+    ctx.num_threads = num_threads < ctx.num_nodes ? num_threads : ctx.num_nodes;
+    run_parallel(&ctx, build_leaves);
+
+    // Stitch the leaf runs of neighbouring threads together
+    for (j = 1; j < ctx.num_threads; j++) {
+        int first = part_start(ctx.num_nodes, ctx.num_threads, j);
+        SET_NEXT_LEAF(ctx.nodes[first - 1], ctx.nodes[first]);
+    }
+    g_rightmost_leaf = ctx.nodes[ctx.num_nodes - 1];
+
+    // Build internal levels until a single root remains
+    while (ctx.num_nodes > 1) {
+        ctx.num_parents = (ctx.num_nodes + N - 1) / N;
+        if (!(ctx.parents = (NODE **)malloc(sizeof(NODE *) * ctx.num_parents))) ERR;
+        if (!(ctx.parent_mins = (int *)malloc(sizeof(int) * ctx.num_parents))) ERR;
+
+        ctx.num_threads = num_threads < ctx.num_parents ? num_threads : ctx.num_parents;
+        run_parallel(&ctx, build_parents);
+
+        level = ctx.nodes;
+        level_mins = ctx.mins;
+        ctx.nodes = ctx.parents;
+        ctx.mins = ctx.parent_mins;
+        ctx.num_nodes = ctx.num_parents;
+        free(level);
+        free(level_mins);
+    }
+
+    g_root = ctx.nodes[0];
+    g_root->parent = NULL_REF;
+    g_seq_inserts = 0;
+
+    // Keys were added wholesale, the filter recounts them and the layer is rebuilt on next use
+    g_filter.stale = 1;
+    g_layer.version++;
+
+    free(ctx.nodes);
+    free(ctx.mins);
+}
+
+void bptree_bulk_load(const int *keys, DATA **data, int count, int num_threads) {
+    BULK_CTX ctx;
+    int t, b, offset;
+
+    if (count <= 0) {
+        return;
+    }
+
+    // Bulk building only makes sense for an empty tree
+    if (g_root != NULL && !(g_root->is_leaf == 1 && g_root->num_keys == 0)) {
+        for (t = 0; t < count; t++) {
+            bptree_insert(keys[t], data ? data[t] : NULL);
+        }
+        return;
+    }
+    bptree_destroy();
+
+    if (num_threads < 1) {
+        num_threads = 1;
+    } else if (num_threads > MAX_BULK_THREADS) {
+        num_threads = MAX_BULK_THREADS;
+    }
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.keys = keys;
+    ctx.data = data;
+    ctx.count = count;
+    ctx.num_threads = num_threads;
+
+    if (!(ctx.entries = (ENTRY *)malloc(sizeof(ENTRY) * count))) ERR;
+    if (!(ctx.splitters = (int *)malloc(sizeof(int) * num_threads))) ERR;
+    if (!(ctx.bucket_count = (int *)calloc(num_threads * num_threads, sizeof(int)))) ERR;
+    if (!(ctx.bucket_start = (int *)malloc(sizeof(int) * (num_threads + 1)))) ERR;
+
+    // Sample sort: partition by key range, then sort each partition
+    choose_splitters(&ctx);
+    run_parallel(&ctx, count_buckets);
+
+    // Turn per-thread counts into write offsets, bucket by bucket
+    offset = 0;
+    for (b = 0; b < num_threads; b++) {
+        ctx.bucket_start[b] = offset;
+        for (t = 0; t < num_threads; t++) {
+            int n = ctx.bucket_count[t * num_threads + b];
+            ctx.bucket_count[t * num_threads + b] = offset;
+            offset += n;
+        }
+    }
+    ctx.bucket_start[num_threads] = offset;
+
+    run_parallel(&ctx, scatter_buckets);
+    run_parallel(&ctx, sort_bucket);
+
+    build_from_sorted(ctx.entries, count, num_threads);
+
+    free(ctx.entries);
+    free(ctx.splitters);
+    free(ctx.bucket_count);
+    free(ctx.bucket_start);
+}
@@ -2,24 +2,59 @@
 
 void bptree_delete(int key) {
     NODE *leaf;
+    int i;
+
+    TRACE_OP(TRACE_DELETE, key, 0);
+
+    // Keys the filter has never seen need no descent
+    if (g_root == NULL || FILTER_MISS(key)) {
+        return;
+    }
+
+#ifdef BPTREE_BEPSILON
+    if (g_root->is_leaf == 0) {
+        buffer_message(key, MSG_DELETE, NULL_REF);
+        return;
+    }
+#endif
 
-    leaf = find_leaf(g_root, key);
+    // Copies of key may all sit left of a separator equal to it
+    leaf = find_leaf_first(g_root, key);
+    i = leaf_find_first(&leaf, key);
+    if (i < 0) {
+        // Missing key, the leaf must not be touched
+        return;
+    }
+#ifdef BPTREE_COMPACT_REFS
+    // The tree owns its copy of the data, release it before the slot goes away
+    free_data(leaf->child[i]);
+#endif
+    FILTER_REMOVE(key);
     delete_entry(leaf, key, NULL);
+    STAT_INC(deletes);
 }
 
 void delete_entry(NODE *node, int key, NODE *child_node) {
     NODE *sibling_node, *temp_node;
     int parent_key, borrow_index, i;
 
+    if (node->is_leaf == 0) {
+        LAYER_TOUCH(node);
+    }
+
     // Delete key and child pointer from the node
     delete_from_node(node, key, child_node);
 
     // Root shrinking: (key=1, child=2) → delete → (key=0, child=1)
     // Promote the only remaining child to become new root
-    if (node->parent == NULL && count_child(node) == 1) {
-        g_root = node->child[0];    // After shift(delete_from_node), only child[0] remains
-        g_root->parent = NULL;
-        free(node);
+    if (node->parent == NULL_REF && node->is_leaf == 0 && count_child(node) == 1) {
+        g_root = CHILD(node, 0);    // After shift(delete_from_node), only child[0] remains
+        g_root->parent = NULL_REF;
+#ifdef BPTREE_BEPSILON
+        buffer_push_down(node, g_root);
+#endif
+        free_node(node);
+        STAT_INC(root_shrinks);
         return;
     }
 
@@ -27,9 +62,9 @@ void delete_entry(NODE *node, int key, NODE *child_node) {
     int is_leaf_underflow = (node->is_leaf && node->num_keys < (int)ceil((N - 1) / 2.0));
     int is_internal_underflow = (!node->is_leaf && node->num_keys + 1 < (int)ceil(N / 2.0));
     
-    if (node->parent != NULL && (is_leaf_underflow || is_internal_underflow)) {
-        sibling_node = find_sibling_node(node->parent, node);
-        parent_key = find_parent_key(node->parent, node, sibling_node);
+    if (node->parent != NULL_REF && (is_leaf_underflow || is_internal_underflow)) {
+        sibling_node = find_sibling_node(PARENT(node), node);
+        parent_key = find_parent_key(PARENT(node), node, sibling_node);
 
         // Check if merge is possible
         int total_keys = node->num_keys + sibling_node->num_keys;
@@ -38,7 +73,7 @@ void delete_entry(NODE *node, int key, NODE *child_node) {
         if (total_keys < N && total_children < N + 1) {
             // Merge with sibling node
             // Ensure sibling_node->node order
-            if (check_node_order(node->parent, node, sibling_node) == 1) {
+            if (check_node_order(PARENT(node), node, sibling_node) == 1) {
                 temp_node = sibling_node;
                 sibling_node = node;
                 node = temp_node;
@@ -49,17 +84,34 @@ void delete_entry(NODE *node, int key, NODE *child_node) {
                 sibling_node->key[sibling_node->num_keys] = parent_key;
                 sibling_node->num_keys++;
                 merge_node_into_sibling_node(node, sibling_node);
+#ifdef BPTREE_BEPSILON
+                buffer_merge(node, sibling_node);
+#endif
+                STAT_INC(internal_merges);
             } else {
                 // Leaf node
                 merge_node_into_sibling_node(node, sibling_node);
                 sibling_node->parent = node->parent;
+                STAT_INC(leaf_merges);
             }
     
-            delete_entry(node->parent, parent_key, node);
-            free(node);
+            // node was merged away, its left sibling now ends the leaf chain
+            if (node == g_rightmost_leaf) {
+                g_rightmost_leaf = sibling_node;
+            }
+
+            delete_entry(PARENT(node), parent_key, node);
+            free_node(node);
         } else {
             // Cannot merge, redistribute by borrowing from sibling
-            if (check_node_order(node->parent, node, sibling_node) == 0) {
+            LAYER_TOUCH(PARENT(node));
+            if (node->is_leaf == 0) {
+                STAT_INC(internal_borrows);
+            } else {
+                STAT_INC(leaf_borrows);
+            }
+
+            if (check_node_order(PARENT(node), node, sibling_node) == 0) {
                 // Borrow from right sibling
                 if (node->is_leaf == 0) {
                     // Internal node: borrow last child and move parent key down
@@ -76,37 +128,41 @@ void delete_entry(NODE *node, int key, NODE *child_node) {
                     // Insert parent key and borrowed child
                     node->key[0] = parent_key;
                     node->child[0] = sibling_node->child[borrow_index];
-                    node->child[0]->parent = node;
+                    SET_PARENT(CHILD(node, 0), node);
                     node->num_keys++;
 
                     // Update parent key with sibling's promoted key
-                    for (i = 0; i < node->parent->num_keys; i++) {
-                        if (node->parent->key[i] == parent_key) {
-                            node->parent->key[i] = sibling_node->key[borrow_index - 1];
+                    for (i = 0; i < PARENT(node)->num_keys; i++) {
+                        if (PARENT(node)->key[i] == parent_key) {
+                            PARENT(node)->key[i] = sibling_node->key[borrow_index - 1];
                             break;
                         }
                     }
 
                     // Remove borrowed elements from sibling
                     sibling_node->key[borrow_index - 1] = 0;
-                    sibling_node->child[borrow_index] = NULL;
+                    sibling_node->child[borrow_index] = NULL_REF;
                     sibling_node->num_keys--;
+#ifdef BPTREE_BEPSILON
+                    buffer_rebalance(PARENT(node), sibling_node, node);
+#endif
                 } else {
                     // Leaf node: borrow last key-data pair
+                    leaf_sort(sibling_node);
                     borrow_index = sibling_node->num_keys - 1;
-                    insert_in_leaf(node, sibling_node->key[borrow_index], (DATA *)sibling_node->child[borrow_index]);
+                    insert_in_leaf(node, sibling_node->key[borrow_index], sibling_node->child[borrow_index]);
                     
                     // Update parent boundary key
-                    for (i = 0; i < node->parent->num_keys; i++) {
-                        if (node->parent->key[i] == parent_key) {
-                            node->parent->key[i] = sibling_node->key[borrow_index];
+                    for (i = 0; i < PARENT(node)->num_keys; i++) {
+                        if (PARENT(node)->key[i] == parent_key) {
+                            PARENT(node)->key[i] = sibling_node->key[borrow_index];
                             break;
                         }
                     }
 
                     // Remove borrowed element from sibling
                     sibling_node->key[borrow_index] = 0;
-                    sibling_node->child[borrow_index] = NULL;
+                    sibling_node->child[borrow_index] = NULL_REF;
                     sibling_node->num_keys--;
                 }
             } else {
@@ -115,33 +171,39 @@ void delete_entry(NODE *node, int key, NODE *child_node) {
                     // Internal node: move parent key down and borrow first child
                     node->key[node->num_keys] = parent_key;
                     node->child[node->num_keys + 1] = sibling_node->child[0];
-                    node->child[node->num_keys + 1]->parent = node;
+                    SET_PARENT(CHILD(node, node->num_keys + 1), node);
                     node->num_keys++;
 
                     // Update parent key with sibling's first key
-                    for (i = 0; i < sibling_node->parent->num_keys; i++) {
-                        if (sibling_node->parent->key[i] == parent_key) {
-                            sibling_node->parent->key[i] = sibling_node->key[0];
+                    for (i = 0; i < PARENT(sibling_node)->num_keys; i++) {
+                        if (PARENT(sibling_node)->key[i] == parent_key) {
+                            PARENT(sibling_node)->key[i] = sibling_node->key[0];
                             break;
                         }
                     }
 
-                    delete_from_node(sibling_node, sibling_node->key[0], sibling_node->child[0]);
+                    delete_from_node(sibling_node, sibling_node->key[0], CHILD(sibling_node, 0));
+#ifdef BPTREE_BEPSILON
+                    buffer_rebalance(PARENT(node), node, sibling_node);
+#endif
                 } else {
                     // Leaf node: borrow first key-data pair
+                    leaf_sort(sibling_node);
                     node->key[node->num_keys] = sibling_node->key[0];
                     node->child[node->num_keys] = sibling_node->child[0];
+                    SET_FINGERPRINT(node, node->num_keys);
                     node->num_keys++;
 
-                    // Update parent boundary key
-                    for (i = 0; i < sibling_node->parent->num_keys; i++) {
-                        if (sibling_node->parent->key[i] == parent_key) {
-                            sibling_node->parent->key[i] = sibling_node->key[0];
+                    delete_from_node(sibling_node, sibling_node->key[0], NULL);
+                    leaf_sort(sibling_node);
+
+                    // Update parent boundary key with sibling's new first key
+                    for (i = 0; i < PARENT(sibling_node)->num_keys; i++) {
+                        if (PARENT(sibling_node)->key[i] == parent_key) {
+                            PARENT(sibling_node)->key[i] = sibling_node->key[0];
                             break;
                         }
                     }
-
-                    delete_from_node(sibling_node, sibling_node->key[0], sibling_node->child[0]);
                 }
             }
         }
@@ -151,12 +213,33 @@ void delete_entry(NODE *node, int key, NODE *child_node) {
 void delete_from_node(NODE *node, int key, NODE *child_node) {
     int i, j, data_index;
 
+#ifdef BPTREE_UNSORTED_LEAVES
+    if (child_node == NULL) {
+        // Unsorted leaf: move the last entry into the hole instead of shifting
+        i = leaf_find(node, key);
+        if (i < 0) {
+            return;
+        }
+        node->num_keys--;
+        node->key[i] = node->key[node->num_keys];
+        node->child[i] = node->child[node->num_keys];
+        node->fp[i] = node->fp[node->num_keys];
+        node->key[node->num_keys] = 0;
+        node->child[node->num_keys] = NULL_REF;
+        return;
+    }
+#endif
+
     // Find the key to delete
     for (i = 0; i < node->num_keys; i++) {
         if (node->key[i] == key) {
             break;
         }
     }
+    if (i == node->num_keys) {
+        // Not in this node, shifting would drop the last entry instead
+        return;
+    }
     
     // Save key position for data index in leaf node
     data_index = i;
@@ -178,14 +261,14 @@ void delete_from_node(NODE *node, int key, NODE *child_node) {
 
         // Clear the last data pointer
         if (node->num_keys > 0) {
-            node->child[node->num_keys - 1] = NULL;
+            node->child[node->num_keys - 1] = NULL_REF;
         } else {
-            node->child[0] = NULL;
+            node->child[0] = NULL_REF;
         }
     } else {
         // Internal node: find and delete specific child pointer
         for (j = 0; j < node->num_keys + 1; j++) {
-            if (node->child[j] == child_node) {
+            if (CHILD(node, j) == child_node) {
                 break;
             }
         }
@@ -196,7 +279,7 @@ void delete_from_node(NODE *node, int key, NODE *child_node) {
         }
 
         // Clear the last child pointer
-        node->child[node->num_keys] = NULL;
+        node->child[node->num_keys] = NULL_REF;
     }
 
     node->num_keys--;
@@ -211,7 +294,9 @@ void merge_node_into_sibling_node(NODE *node, NODE *sibling_node) {
 		sibling_node->key[sibling_node->num_keys + i] = node->key[i];
 		sibling_node->child[sibling_node->num_keys + i] = node->child[i];
 		if(sibling_node->is_leaf == 0) {
-			sibling_node->child[sibling_node->num_keys + i]->parent = sibling_node;	// Update parent pointer
+			SET_PARENT(CHILD(sibling_node, sibling_node->num_keys + i), sibling_node);	// Update parent pointer
+		} else {
+			SET_FINGERPRINT(sibling_node, sibling_node->num_keys + i);
 		}
 	}
 
@@ -220,7 +305,7 @@ void merge_node_into_sibling_node(NODE *node, NODE *sibling_node) {
     // For internal nodes, copy the last child pointer
 	if(node->is_leaf == 0) {
 		sibling_node->child[sibling_node->num_keys] = node->child[node->num_keys];
-		sibling_node->child[sibling_node->num_keys]->parent = sibling_node;
+		SET_PARENT(CHILD(sibling_node, sibling_node->num_keys), sibling_node);
 	} else {
 		// For leaf nodes, inherit the next pointer
 		sibling_node->child[N - 1] = node->child[N - 1];
@@ -232,14 +317,14 @@ int check_node_order(NODE *parent_node, NODE *child_node, NODE *sibling_node) {
 
     // Find which node appears first in parent's children
     for (i = 0; i < parent_node->num_keys + 1; i++) {
-        if (parent_node->child[i] == child_node || 
-            parent_node->child[i] == sibling_node) {
+        if (CHILD(parent_node, i) == child_node || 
+            CHILD(parent_node, i) == sibling_node) {
             break;
         }
     }
 
     // Return 1 if child_node comes first
-    if (parent_node->child[i] == child_node) {
+    if (CHILD(parent_node, i) == child_node) {
         return 1;
     } else {
         return 0;
@@ -250,7 +335,7 @@ int count_child(NODE *node) {
     int i, count = 0;
 
     for (i = 0; i < node->num_keys + 1; i++) {
-        if (node->child[i] != NULL) {
+        if (node->child[i] != NULL_REF) {
             count++;
         }
     }
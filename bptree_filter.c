@@ -0,0 +1,153 @@
+#include <string.h>
+
+#include "bptree.h"
+
+// Blocked counting Bloom filter over the keys of the tree.
+// A key hashes to one block of FILTER_BLOCK one-byte counters (a cache line)
+// and FILTER_HASHES counters inside it, so a query costs one cache miss.
+// Counters stick at 255 so an overflow can only cause false positives.
+
+FILTER g_filter;
+
+static unsigned long long filter_hash(int key) {
+    unsigned long long h = (unsigned int)key;
+
+    // fmix64 from MurmurHash3
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// Low bits pick the block, the top FILTER_HASHES * 6 bits the counters in it
+static unsigned char *filter_block(unsigned long long h) {
+    return g_filter.counts + (h & (g_filter.num_blocks - 1)) * FILTER_BLOCK;
+}
+
+static int counter_index(unsigned long long h, int i) {
+    return (int)(h >> (64 - 6 * (i + 1))) & (FILTER_BLOCK - 1);
+}
+
+static void add_hash(unsigned long long h) {
+    unsigned char *block = filter_block(h);
+    int i;
+
+    for (i = 0; i < FILTER_HASHES; i++) {
+        if (block[counter_index(h, i)] < 255) {
+            block[counter_index(h, i)]++;
+        }
+    }
+}
+
+// Size the table for capacity keys and count every key of the tree again
+static void filter_rebuild(long long capacity) {
+    unsigned long long blocks = 1;
+    NODE *leaf;
+    int i;
+
+    // Buffered inserts are counted already, so rebuilding from the leaves needs them applied
+    bptree_flush();
+
+    while (blocks * FILTER_BLOCK < (unsigned long long)capacity * FILTER_COUNTERS_PER_KEY) {
+        blocks *= 2;
+    }
+    if (blocks != g_filter.num_blocks) {
+        free(g_filter.counts);
+        if (!(g_filter.counts = (unsigned char *)malloc(blocks * FILTER_BLOCK))) ERR;
+        g_filter.num_blocks = blocks;
+    }
+    memset(g_filter.counts, 0, g_filter.num_blocks * FILTER_BLOCK);
+    g_filter.capacity = (long long)(g_filter.num_blocks * FILTER_BLOCK / FILTER_COUNTERS_PER_KEY);
+    g_filter.num_keys = 0;
+    g_filter.stale = 0;
+
+    leaf = g_root ? find_leftmost_leaf(g_root) : NULL;
+    for (; leaf != NULL; leaf = NEXT_LEAF(leaf)) {
+        for (i = 0; i < leaf->num_keys; i++) {
+            add_hash(filter_hash(leaf->key[i]));
+        }
+        g_filter.num_keys += leaf->num_keys;
+    }
+}
+
+void bptree_filter_enable(long long expected_keys) {
+    if (expected_keys < 1) {
+        expected_keys = 1;
+    }
+    g_filter.enabled = 1;
+    filter_rebuild(expected_keys);
+}
+
+void bptree_filter_disable(void) {
+    free(g_filter.counts);
+    memset(&g_filter, 0, sizeof(g_filter));
+}
+
+void filter_add(int key) {
+    if (g_filter.stale || g_filter.num_keys >= g_filter.capacity) {
+        // Past capacity the false positive rate climbs, so double the table
+        filter_rebuild(g_filter.num_keys >= g_filter.capacity ? g_filter.capacity * 2 : g_filter.capacity);
+    }
+    add_hash(filter_hash(key));
+    g_filter.num_keys++;
+}
+
+void filter_remove(int key) {
+    unsigned long long h = filter_hash(key);
+    unsigned char *block = filter_block(h);
+    int i;
+
+    if (g_filter.stale) {
+        return;
+    }
+    for (i = 0; i < FILTER_HASHES; i++) {
+        if (block[counter_index(h, i)] > 0 && block[counter_index(h, i)] < 255) {
+            block[counter_index(h, i)]--;
+        }
+    }
+    g_filter.num_keys--;
+}
+
+void filter_remove_tree(NODE *node) {
+    int i;
+
+    if (node == NULL) {
+        return;
+    }
+    if (node->is_leaf == 0) {
+        for (i = 0; i < node->num_keys + 1; i++) {
+            filter_remove_tree(CHILD(node, i));
+        }
+        return;
+    }
+    for (i = 0; i < node->num_keys; i++) {
+        filter_remove(node->key[i]);
+    }
+}
+
+void filter_clear(void) {
+    memset(g_filter.counts, 0, g_filter.num_blocks * FILTER_BLOCK);
+    g_filter.num_keys = 0;
+    g_filter.stale = 0;
+}
+
+int filter_may_contain(int key) {
+    unsigned long long h;
+    unsigned char *block;
+    int i;
+
+    if (g_filter.stale) {
+        filter_rebuild(g_filter.num_keys > g_filter.capacity ? g_filter.num_keys : g_filter.capacity);
+    }
+    h = filter_hash(key);
+    block = filter_block(h);
+    for (i = 0; i < FILTER_HASHES; i++) {
+        if (block[counter_index(h, i)] == 0) {
+            STAT_INC(filter_negatives);
+            return 0;
+        }
+    }
+    return 1;
+}
\ No newline at end of file
@@ -1,55 +1,281 @@
 #include "bptree.h"
 
-void bptree_insert(int key, DATA *data) {
-    NODE *leaf, *new_leaf;
-    TEMP *temp;
+// Leaf that key belongs in: the rightmost leaf when key is not below its largest
+// key, otherwise the one found by a descent. An empty tree gets its first leaf.
+static NODE *target_leaf(int key, int *append) {
+    NODE *leaf;
 
-    // Check if the tree is empty
+    *append = 0;
     if (g_root == NULL) {
         // Tree is empty, create the first leaf node as root
         leaf = alloc_leaf(NULL);
         g_root = leaf;
+        g_rightmost_leaf = leaf;
+        return leaf;
+    }
+    if (g_rightmost_leaf != NULL && g_rightmost_leaf->num_keys > 0 &&
+        key >= g_rightmost_leaf->key[g_rightmost_leaf->num_keys - 1]) {
+        // Appending past the largest key, skip the descent
+        *append = 1;
+        return g_rightmost_leaf;
+    }
+    return find_leaf(g_root, key);
+}
+
+// Insert into the leaf from target_leaf, splitting it if it is full
+static void insert_at(NODE *leaf, int key, NODE_REF value, int append) {
+    // Only inserts that took the fast path count towards sequential mode
+    if (append) {
+        STAT_INC(append_inserts);
+        if (g_seq_inserts < SEQ_THRESHOLD) {
+            g_seq_inserts++;
+        }
     } else {
-        // Tree exists, find the appropriate leaf node for insertion
-        leaf = find_leaf(g_root, key);
+        g_seq_inserts = 0;
     }
 
     // Check if we can insert without splitting
     if (leaf->num_keys < N - 1) {
         // Space available, insert directly
-        insert_in_leaf(leaf, key, data);
+        insert_in_leaf(leaf, key, value);
     } else {
         // No space, split the leaf node
-        // Create temporary structure to hold all keys + new key
-        temp = alloc_temp(leaf);
-        insert_in_temp(temp, key, (NODE *)data);
+        split_leaf(leaf, key, value);
+    }
+}
 
-        // Create new leaf node
-        new_leaf = alloc_leaf(leaf->parent);
+// Shared by bptree_insert_unique and bptree_get_or_insert: returns 1 if key is
+// there (*out gets its data), 0 once data is inserted (*out gets the stored data)
+static int find_or_insert(int key, DATA *data, DATA **out) {
+    NODE_REF value;
+    NODE *leaf;
+    int i, append;
+
+#ifdef BPTREE_BEPSILON
+    // Pending messages decide whether key is there, the insert itself is buffered
+    if (g_root != NULL && g_root->is_leaf == 0) {
+        if (!FILTER_MISS(key) && buffer_get(key, out)) {
+            return 1;
+        }
+        value = alloc_data(data);
+        STAT_INC(inserts);
+        FILTER_ADD(key);
+        buffer_message(key, MSG_INSERT, value);
+        if (out != NULL) {
+            *out = DATA_PTR(value);
+        }
+        return 0;
+    }
+#endif
 
-        // Set up leaf linking before clearing
-        new_leaf->child[N - 1] = leaf->child[N - 1];  // new_leaf points to leaf's next
-        
-        // Clear the original leaf node
-        clear_node(leaf);
+    leaf = target_leaf(key, &append);
+    i = leaf_find(leaf, key);
+    if (i >= 0) {
+        if (out != NULL) {
+            *out = LEAF_DATA(leaf, i);
+        }
+        return 1;
+    }
 
-        // Redistribute keys between original and new leaf nodes
-        split_temp_to_nodes(leaf, new_leaf, temp);
-        
-        // Update leaf linking after split
-        leaf->child[N - 1] = new_leaf;  // leaf points to new_leaf
+    value = alloc_data(data);
+    STAT_INC(inserts);
+    FILTER_ADD(key);
+    insert_at(leaf, key, value, append);
+    if (out != NULL) {
+        *out = DATA_PTR(value);
+    }
+    return 0;
+}
+
+void bptree_insert(int key, DATA *data) {
+    NODE *leaf;
+    int append;
+
+    STAT_INC(inserts);
+    TRACE_OP(TRACE_INSERT, key, 0);
+    FILTER_ADD(key);
+
+#ifdef BPTREE_BEPSILON
+    // Once the root is internal, inserts are parked in its buffer
+    if (g_root != NULL && g_root->is_leaf == 0) {
+        buffer_message(key, MSG_INSERT, alloc_data(data));
+        return;
+    }
+#endif
+
+    leaf = target_leaf(key, &append);
+    insert_at(leaf, key, alloc_data(data), append);
+}
+
+void bptree_upsert(int key, DATA *data) {
+    NODE *leaf;
+    int i, append;
+
+    TRACE_OP(TRACE_UPSERT, key, 0);
+
+#ifdef BPTREE_BEPSILON
+    // Whether key is there is settled at the leaf, so the filter counts it now
+    // and apply_message takes it back out if the value is replaced
+    if (g_root != NULL && g_root->is_leaf == 0) {
+        FILTER_ADD(key);
+        buffer_message(key, MSG_UPSERT, alloc_data(data));
+        return;
+    }
+#endif
+
+    leaf = target_leaf(key, &append);
+    i = leaf_find(leaf, key);
+    if (i >= 0) {
+        // Existing key, swap the value and leave the structure alone
+        free_data(leaf->child[i]);
+        leaf->child[i] = alloc_data(data);
+        STAT_INC(updates);
+        return;
+    }
+
+    STAT_INC(inserts);
+    FILTER_ADD(key);
+    insert_at(leaf, key, alloc_data(data), append);
+}
+
+int bptree_insert_unique(int key, DATA *data) {
+    TRACE_OP(TRACE_INSERT_UNIQUE, key, 0);
+    return !find_or_insert(key, data, NULL);
+}
+
+int bptree_get_or_insert(int key, DATA *data, DATA **out) {
+    TRACE_OP(TRACE_GET_OR_INSERT, key, 0);
+    return find_or_insert(key, data, out);
+}
+
+void bptree_insert_topdown(int key, DATA *data) {
+    NODE *node, *new_node;
+    int i, promoted_key;
+
+    // A full node has N children, with an odd N one half of a preemptive
+    // split would fall below the minimum fill, so split bottom-up instead
+    if (g_root == NULL || N % 2 == 1) {
+        bptree_insert(key, data);
+        return;
+    }
+
+    // Pending messages for this key must land before it
+    bptree_flush();
+
+    STAT_INC(inserts);
+    TRACE_OP(TRACE_INSERT, key, 0);
+    FILTER_ADD(key);
+
+    // Every insert descends, so sequential mode never applies here
+    g_seq_inserts = 0;
+    node = g_root;
+
+    while (node->is_leaf == 0) {
+        // Split full nodes on the way down so the parent always has room
+        if (node->num_keys == N - 1) {
+            promoted_key = node->key[(N - 1) / 2];
+            new_node = split_full_node(node);
+            if (key >= promoted_key) {
+                node = new_node;
+            }
+        }
 
-        // Promote key to parent level
-        insert_in_parent(leaf, new_leaf->key[0], new_leaf);
+        // Find appropriate child to descend into
+        for (i = 0; i < node->num_keys; i++) {
+            if (key < node->key[i]) {
+                break;
+            }
+        }
+        node = NODE_AT(node->child[i]);
+    }
 
-        // Cleanup
-        free(temp);
+    if (node->num_keys < N - 1) {
+        insert_in_leaf(node, key, alloc_data(data));
+    } else {
+        // Parent has room, so insert_in_parent does not cascade
+        split_leaf(node, key, alloc_data(data));
     }
 }
 
-NODE *insert_in_leaf(NODE *leaf, int key, DATA *data) {
+NODE *split_leaf(NODE *leaf, int key, NODE_REF value) {
+    NODE *new_leaf;
+    TEMP *temp;
+
+    // Create temporary structure to hold all keys + new key
+    leaf_sort(leaf);
+    temp = alloc_temp(leaf);
+    insert_in_temp(temp, key, value);
+
+    // Create new leaf node
+    new_leaf = alloc_leaf(PARENT(leaf));
+
+    // Set up leaf linking before clearing
+    new_leaf->child[N - 1] = leaf->child[N - 1];  // new_leaf points to leaf's next
+
+    // Clear the original leaf node
+    clear_node(leaf);
+
+    // Redistribute keys between original and new leaf nodes
+    split_temp_to_nodes(leaf, new_leaf, temp);
+
+    // Update leaf linking after split
+    SET_NEXT_LEAF(leaf, new_leaf);  // leaf points to new_leaf
+    if (leaf == g_rightmost_leaf) {
+        g_rightmost_leaf = new_leaf;
+    }
+
+    // Promote key to parent level
+    insert_in_parent(leaf, new_leaf->key[0], new_leaf);
+
+    // Cleanup
+    free(temp);
+
+    return new_leaf;
+}
+
+NODE *split_full_node(NODE *node) {
+    NODE *new_node;
+    int i, split_index, promoted_key;
+
+    // Keep the lower half, promote the middle key, move the upper half
+    split_index = (N - 1) / 2;
+    promoted_key = node->key[split_index];
+
+    new_node = alloc_leaf(PARENT(node));
+    new_node->is_leaf = 0;
+    STAT_INC(internal_splits);
+
+    for (i = split_index + 1; i < node->num_keys; i++) {
+        new_node->key[new_node->num_keys] = node->key[i];
+        new_node->child[new_node->num_keys] = node->child[i];
+        SET_PARENT(CHILD(new_node, new_node->num_keys), new_node);
+        new_node->num_keys++;
+        node->key[i] = 0;
+        node->child[i] = NULL_REF;
+    }
+    new_node->child[new_node->num_keys] = node->child[node->num_keys];
+    SET_PARENT(CHILD(new_node, new_node->num_keys), new_node);
+    node->child[node->num_keys] = NULL_REF;
+    node->key[split_index] = 0;
+    node->num_keys = split_index;
+#ifdef BPTREE_BEPSILON
+    buffer_split(node, new_node, promoted_key);
+#endif
+
+    // Parent is never full here, so this does not recurse
+    insert_in_parent(node, promoted_key, new_node);
+
+    return new_node;
+}
+
+NODE *insert_in_leaf(NODE *leaf, int key, NODE_REF value) {
     int i, j;
-    
+
+#ifdef BPTREE_UNSORTED_LEAVES
+    // Unsorted leaf: append, no shifting
+    i = leaf->num_keys;
+    (void)j;
+#else
     // Find insertion position
     for (i = 0; i < leaf->num_keys; i++) {
         if (key < leaf->key[i]) {
@@ -62,16 +288,18 @@ NODE *insert_in_leaf(NODE *leaf, int key, DATA *data) {
         leaf->key[j] = leaf->key[j - 1];
         leaf->child[j] = leaf->child[j - 1];
     }
+#endif
 
-    // Insert new key-data pair
+    // Insert new key-value pair
     leaf->key[i] = key;
-    leaf->child[i] = (NODE *)data;
+    leaf->child[i] = value;
+    SET_FINGERPRINT(leaf, i);
     leaf->num_keys++;
 
     return leaf;
 }
 
-TEMP *insert_in_temp(TEMP *temp, int key, NODE *child_node) {
+TEMP *insert_in_temp(TEMP *temp, int key, NODE_REF child_node) {
     int i, j;
 
     // Find insertion position
@@ -103,16 +331,45 @@ TEMP *insert_in_temp(TEMP *temp, int key, NODE *child_node) {
     return temp;
 }
 
+int calc_split_index(TEMP *temp) {
+    int right_keys;
+
+    if (g_seq_inserts < SEQ_THRESHOLD) {
+        // Random inserts: split evenly. An internal split also promotes one key,
+        // so rounding down keeps the right half at the minimum for odd N.
+        if (temp->is_leaf == 1) {
+            return (int)ceil(temp->num_keys / 2.0);
+        }
+        return temp->num_keys / 2;
+    }
+
+    // Sequential inserts only ever append to the right node, so keep it small
+    right_keys = (int)(temp->num_keys * (1.0 - SEQ_SPLIT_RATIO));
+    if (right_keys < 1) {
+        right_keys = 1;
+    }
+
+    // Internal split also promotes the key at split_index
+    if (temp->is_leaf == 1) {
+        return temp->num_keys - right_keys;
+    } else {
+        return temp->num_keys - right_keys - 1;
+    }
+}
+
 int split_temp_to_nodes(NODE *node, NODE *new_node, TEMP *temp) {
     int i, split_index;
-    split_index = (int)ceil(temp->num_keys / 2.0);
+    split_index = calc_split_index(temp);
 
     if (temp->is_leaf == 1) {
+        STAT_INC(leaf_splits);
+
         // Leaf node split: distribute keys evenly
         // First half goes to original node
         for (i = 0; i < split_index; i++) {
             node->key[i] = temp->key[i];
             node->child[i] = temp->child[i];
+            SET_FINGERPRINT(node, i);
             node->num_keys++;
         }
         
@@ -120,32 +377,35 @@ int split_temp_to_nodes(NODE *node, NODE *new_node, TEMP *temp) {
         for (i = 0; i < temp->num_keys - split_index; i++) {
             new_node->key[i] = temp->key[split_index + i];
             new_node->child[i] = temp->child[split_index + i];
+            SET_FINGERPRINT(new_node, i);
             new_node->num_keys++;
         }
         
         // Link leaf to new_leaf for linear traversal
-        node->child[N - 1] = new_node;
+        SET_NEXT_LEAF(node, new_node);
     } else {
+        STAT_INC(internal_splits);
+
         // Internal node split: middle key is promoted to parent
         // First half goes to original node
         for (i = 0; i < split_index; i++) {
             node->key[i] = temp->key[i];
             node->child[i] = temp->child[i];
-            node->child[i]->parent = node;  // Update child's parent pointer
+            SET_PARENT(CHILD(node, i), node);  // Update child's parent pointer
             node->num_keys++;
         }
         node->child[i] = temp->child[i];
-        node->child[i]->parent = node;
+        SET_PARENT(CHILD(node, i), node);
         
         // Second half goes to new node (skip the middle key)
         for (i = 0; i < temp->num_keys - (split_index + 1); i++) {
             new_node->key[i] = temp->key[split_index + 1 + i];
             new_node->child[i] = temp->child[split_index + 1 + i];
-            new_node->child[i]->parent = new_node;  // Update child's parent pointer
+            SET_PARENT(CHILD(new_node, i), new_node);  // Update child's parent pointer
             new_node->num_keys++;
         }
         new_node->child[i] = temp->child[split_index + 1 + i];
-        new_node->child[i]->parent = new_node;
+        SET_PARENT(CHILD(new_node, i), new_node);
 
         // Return the middle key to be promoted to parent
         return temp->key[split_index];
@@ -157,12 +417,15 @@ int split_temp_to_nodes(NODE *node, NODE *new_node, TEMP *temp) {
 NODE *insert_in_parent(NODE *node, int key, NODE *new_node) {
     NODE *new_root;
 
+    LAYER_TOUCH(node == g_root ? NULL : PARENT(node));
+
     if (node == g_root) {
         // Create new root when splitting the root node
         new_root = alloc_leaf(NULL);
+        STAT_INC(root_splits);
         new_root->key[0] = key;
-        new_root->child[0] = node;
-        new_root->child[1] = new_node;
+        SET_CHILD(new_root, 0, node);
+        SET_CHILD(new_root, 1, new_node);
         new_root->num_keys = 1;
         new_root->is_leaf = 0;
 
@@ -170,12 +433,12 @@ NODE *insert_in_parent(NODE *node, int key, NODE *new_node) {
         g_root = new_root;
 
         // Update parent pointers
-        node->parent = g_root;
-        new_node->parent = g_root;
+        SET_PARENT(node, g_root);
+        SET_PARENT(new_node, g_root);
         return g_root;
 
     } else {
-        NODE *parent = node->parent;
+        NODE *parent = PARENT(node);
 
         if (parent->num_keys < N - 1) {
             // Parent has space, insert directly
@@ -187,16 +450,19 @@ NODE *insert_in_parent(NODE *node, int key, NODE *new_node) {
 
             // Create temporary structure and add new key
             temp = alloc_temp(parent);
-            insert_in_temp(temp, key, new_node);
+            insert_in_temp(temp, key, NODE_REF_OF(new_node));
 
             // Create new internal node
-            new_internal = alloc_leaf(parent->parent);
+            new_internal = alloc_leaf(PARENT(parent));
             new_internal->is_leaf = 0;
 
             clear_node(parent);
 
             // Split the temporary structure into parent and new node
             int promoted_key = split_temp_to_nodes(parent, new_internal, temp);
+#ifdef BPTREE_BEPSILON
+            buffer_split(parent, new_internal, promoted_key);
+#endif
 
             // Recursively promote split up the tree
             insert_in_parent(parent, promoted_key, new_internal);
@@ -211,11 +477,11 @@ NODE *insert_in_parent(NODE *node, int key, NODE *new_node) {
 
 NODE *insert_in_node(NODE *node, int key, NODE *child_node) {
 	int i, j;
-	NODE *parent = node->parent;
+	NODE *parent = PARENT(node);
 	
 	// Find position of current node in parent's children
 	for(i = 0; i < parent->num_keys + 1; i++) {
-		if(parent->child[i] == node) break;
+		if(CHILD(parent, i) == node) break;
 	}
 	
 	// Shift keys and children to make space
@@ -226,7 +492,7 @@ NODE *insert_in_node(NODE *node, int key, NODE *child_node) {
 
 	// Insert new key and child
 	parent->key[i] = key;
-	parent->child[i + 1] = child_node;
+	SET_CHILD(parent, i + 1, child_node);
 	parent->num_keys++;
 
 	return node;
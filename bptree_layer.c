@@ -0,0 +1,184 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <string.h>
+
+#include "bptree.h"
+
+// Read-optimized copy of the upper levels of the tree.
+// Walking the tree in order down to depth d yields the separator keys above d
+// interleaved with the nodes at d, so a key belongs to the node before the first
+// separator at or above it, exactly where find_leaf_first would arrive. The separators
+// are laid out in Eytzinger (BFS) order, so the search is a branch-free walk down
+// an implicit binary tree whose first levels share a few cache lines.
+
+SEARCH_LAYER g_layer;
+
+// In-order walk state of a rebuild
+typedef struct layer_build {
+    int *fences;
+    NODE **targets;
+    int num_fences;
+    int num_targets;
+} LAYER_BUILD;
+
+// Deepest internal level whose nodes fit in max_nodes, with its node count
+static int choose_depth(size_t max_nodes, int *count) {
+    NODE **level, **next;
+    size_t num_level = 1, num_next, i;
+    int depth = 0, j;
+
+    *count = 1;
+    if (g_root == NULL || g_root->is_leaf) {
+        return 0;
+    }
+    if (!(level = (NODE **)malloc(sizeof(NODE *)))) ERR;
+    level[0] = g_root;
+
+    // Stop above the leaves, their splits would invalidate the layer constantly
+    while (CHILD(level[0], 0)->is_leaf == 0) {
+        num_next = 0;
+        for (i = 0; i < num_level; i++) {
+            num_next += level[i]->num_keys + 1;
+        }
+        if (num_next > max_nodes) {
+            break;
+        }
+        if (!(next = (NODE **)malloc(sizeof(NODE *) * num_next))) ERR;
+        num_next = 0;
+        for (i = 0; i < num_level; i++) {
+            for (j = 0; j < level[i]->num_keys + 1; j++) {
+                next[num_next++] = CHILD(level[i], j);
+            }
+        }
+        free(level);
+        level = next;
+        num_level = num_next;
+        depth++;
+    }
+    free(level);
+    *count = (int)num_level;
+    return depth;
+}
+
+static void collect(LAYER_BUILD *build, NODE *node, int depth) {
+    int i;
+
+    if (depth == 0) {
+        build->targets[build->num_targets++] = node;
+        return;
+    }
+    for (i = 0; i < node->num_keys + 1; i++) {
+        collect(build, CHILD(node, i), depth - 1);
+        if (i < node->num_keys) {
+            build->fences[build->num_fences++] = node->key[i];
+        }
+    }
+}
+
+// Fill the subtree of slot k from sorted fences starting at i, returns the next unused i
+static int fill_eytzinger(LAYER_BUILD *build, int i, int k) {
+    if (k <= build->num_fences) {
+        i = fill_eytzinger(build, i, 2 * k);
+        g_layer.keys[k] = build->fences[i];
+        // Keys at or below fence i and above fence i - 1 belong to node i
+        g_layer.nodes[k] = build->targets[i];
+        i = fill_eytzinger(build, i + 1, 2 * k + 1);
+    }
+    return i;
+}
+
+static void layer_rebuild(void) {
+    LAYER_BUILD build;
+    void *keys;
+    int count;
+
+    free(g_layer.keys);
+    free(g_layer.nodes);
+    g_layer.keys = NULL;
+    g_layer.nodes = NULL;
+    g_layer.num_fences = 0;
+    g_layer.built_version = g_layer.version;
+    g_layer.stale_lookups = 0;
+    g_layer.rebuilds++;
+
+    g_layer.depth = choose_depth(g_layer.max_bytes / (sizeof(int) + sizeof(NODE *)), &count);
+    if (g_layer.depth == 0) {
+        return;
+    }
+
+    if (!(build.fences = (int *)malloc(sizeof(int) * (count - 1)))) ERR;
+    if (!(build.targets = (NODE **)malloc(sizeof(NODE *) * count))) ERR;
+    build.num_fences = 0;
+    build.num_targets = 0;
+    collect(&build, g_root, g_layer.depth);
+
+    // Cache-line aligned, so the 16 keys four levels below slot k share one line
+    if (posix_memalign(&keys, 64, sizeof(int) * count) != 0) ERR;
+    g_layer.keys = (int *)keys;
+    if (!(g_layer.nodes = (NODE **)malloc(sizeof(NODE *) * count))) ERR;
+    g_layer.num_fences = build.num_fences;
+    fill_eytzinger(&build, 0, 1);
+    g_layer.last = build.targets[build.num_targets - 1];
+
+    free(build.fences);
+    free(build.targets);
+}
+
+void bptree_layer_enable(size_t max_bytes) {
+    g_layer.enabled = 1;
+    g_layer.max_bytes = max_bytes > 0 ? max_bytes : LAYER_BYTES;
+    layer_rebuild();
+}
+
+void bptree_layer_disable(void) {
+    free(g_layer.keys);
+    free(g_layer.nodes);
+    memset(&g_layer, 0, sizeof(g_layer));
+}
+
+NODE *layer_find(int key) {
+    const int *keys;
+    unsigned int k = 1, n;
+
+    if (g_layer.built_version != g_layer.version) {
+        // While the upper levels keep changing, lookups start at the root, and the
+        // rebuild waits until as many lookups as it has fences have gone by
+        if (++g_layer.stale_lookups <= g_layer.num_fences) {
+            return g_root;
+        }
+        layer_rebuild();
+    }
+    if (g_layer.depth == 0) {
+        return g_root;
+    }
+
+    keys = g_layer.keys;
+    n = (unsigned int)g_layer.num_fences;
+    while (k <= n) {
+        __builtin_prefetch(keys + 16 * k);
+        k = 2 * k + (keys[k] < key);
+    }
+    // Drop the right turns taken after the last left turn; that left turn was
+    // at the first fence at or above key, or there was none
+    k >>= __builtin_ffs(~k);
+    return k != 0 ? g_layer.nodes[k] : g_layer.last;
+}
+
+void layer_touch(NODE *node) {
+    int depth = 0;
+
+    if (g_layer.built_version != g_layer.version) {
+        return;
+    }
+    if (node == NULL) {
+        g_layer.version++;
+        return;
+    }
+    for (; node->parent != NULL_REF; node = PARENT(node)) {
+        depth++;
+    }
+    // Nodes at the layer's depth and below hold no fence
+    if (depth < g_layer.depth) {
+        g_layer.version++;
+    }
+}
\ No newline at end of file
@@ -1,11 +1,214 @@
+#define _DEFAULT_SOURCE
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
 #include "bptree.h"
 
+// mbind policy from <numaif.h>, called through syscall so libnuma is not needed
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+
+NODE_POOL g_node_pool = { NODE_MEMORY_HEAP, -1, NULL, 0, NULL, 0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+
+// Request transparent huge pages (unless already hugetlb) and the NUMA binding
+static void advise_region(char *base, size_t size, int hugetlb) {
+    unsigned long mask;
+
+    if (!hugetlb && madvise(base, size, MADV_HUGEPAGE) == 0) {
+        g_node_pool.thp_regions++;
+    }
+    if (g_node_pool.numa_node >= 0 && g_node_pool.numa_node < (int)(8 * sizeof(mask))) {
+        mask = 1UL << g_node_pool.numa_node;
+        if (syscall(SYS_mbind, base, size, MPOL_BIND, &mask, 8 * sizeof(mask) + 1, 0) == 0) {
+            g_node_pool.numa_regions++;
+        }
+    }
+}
+
+#ifndef BPTREE_COMPACT_REFS
+// Each region starts with a link to the previous one, nodes follow
+#define POOL_HEADER 64
+#define POOL_SLOT ((sizeof(NODE) + 15) & ~(size_t)15)
+
+static void map_region(void) {
+    char *region;
+    int hugetlb = 1;
+
+    region = (char *)mmap(NULL, NODE_REGION_SIZE, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (region == MAP_FAILED) {
+        // No reserved huge pages, fall back to transparent ones
+        hugetlb = 0;
+        region = (char *)mmap(NULL, NODE_REGION_SIZE, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (region == MAP_FAILED) ERR;
+    } else {
+        g_node_pool.hugetlb_regions++;
+    }
+    advise_region(region, NODE_REGION_SIZE, hugetlb);
+    g_node_pool.regions++;
+
+    memcpy(region, &g_node_pool.region, sizeof(char *));
+    g_node_pool.region = region;
+    g_node_pool.region_used = POOL_HEADER;
+}
+
+static NODE *pool_alloc(void) {
+    NODE *node;
+
+    pthread_mutex_lock(&g_node_pool.lock);
+    if (g_node_pool.free_list != NULL) {
+        node = (NODE *)g_node_pool.free_list;
+        memcpy(&g_node_pool.free_list, node, sizeof(void *));
+        memset(node, 0, sizeof(NODE));
+    } else {
+        if (g_node_pool.region == NULL || g_node_pool.region_used + POOL_SLOT > NODE_REGION_SIZE) {
+            map_region();
+        }
+        // Fresh mappings are already zero
+        node = (NODE *)(g_node_pool.region + g_node_pool.region_used);
+        g_node_pool.region_used += POOL_SLOT;
+    }
+    pthread_mutex_unlock(&g_node_pool.lock);
+    return node;
+}
+
+static void pool_free(NODE *node) {
+    pthread_mutex_lock(&g_node_pool.lock);
+    memcpy(node, &g_node_pool.free_list, sizeof(void *));
+    g_node_pool.free_list = node;
+    pthread_mutex_unlock(&g_node_pool.lock);
+}
+#endif
+
+void node_pool_reset(void) {
+#ifndef BPTREE_COMPACT_REFS
+    char *region, *prev;
+
+    for (region = g_node_pool.region; region != NULL; region = prev) {
+        memcpy(&prev, region, sizeof(char *));
+        munmap(region, NODE_REGION_SIZE);
+    }
+    g_node_pool.region = NULL;
+    g_node_pool.region_used = 0;
+    g_node_pool.free_list = NULL;
+#endif
+}
+
+int bptree_set_node_memory(int backend, int numa_node) {
+    if (g_root != NULL && (g_root->is_leaf == 0 || g_root->num_keys > 0)) {
+        return -1;
+    }
+#ifdef BPTREE_COMPACT_REFS
+    // Shared arenas stay where the segment put them
+    if (g_shm.base != NULL) {
+        return -1;
+    }
+#endif
+
+    // Nodes of the old backend go back where they came from
+    bptree_destroy();
+#ifdef BPTREE_COMPACT_REFS
+    // The node arena is reserved again on next use, with the new advice
+    if (g_node_arena.base != NULL) {
+        munmap(g_node_arena.base, ARENA_RESERVE);
+        g_node_arena.base = NULL;
+    }
+#else
+    node_pool_reset();
+#endif
+
+    g_node_pool.backend = backend;
+    g_node_pool.numa_node = numa_node;
+    g_node_pool.regions = 0;
+    g_node_pool.hugetlb_regions = 0;
+    g_node_pool.thp_regions = 0;
+    g_node_pool.numa_regions = 0;
+    return 0;
+}
+
+#ifdef BPTREE_COMPACT_REFS
+ARENA g_node_arena = { NULL, sizeof(NODE), 0, 1, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+ARENA g_data_arena = { NULL, sizeof(DATA), 0, 1, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+
+NODE_REF arena_alloc(ARENA *arena) {
+    NODE_REF ref;
+    size_t max_slots;
+
+    pthread_mutex_lock(&arena->lock);
+
+    // Reserve the whole range up front so slots never move
+    if (arena->base == NULL) {
+        arena->base = (char *)mmap(NULL, ARENA_RESERVE, PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (arena->base == MAP_FAILED) ERR;
+        if (arena == &g_node_arena && g_node_pool.backend == NODE_MEMORY_HUGEPAGE) {
+            advise_region(arena->base, ARENA_RESERVE, 0);
+            g_node_pool.regions++;
+        }
+        max_slots = ARENA_RESERVE / arena->slot_size;
+        arena->max_slots = max_slots > 0xffffffffu ? 0xffffffffu : (unsigned int)max_slots;
+    }
+
+    if (arena->free_list != 0) {
+        // Freed slots keep the next free index in their first bytes
+        ref = arena->free_list;
+        memcpy(&arena->free_list, arena->base + (size_t)ref * arena->slot_size, sizeof(NODE_REF));
+        memset(arena->base + (size_t)ref * arena->slot_size, 0, arena->slot_size);
+    } else {
+        if (arena->next_slot >= arena->max_slots) {
+            errno = ENOMEM;
+            ERR;
+        }
+        // Untouched pages of the reservation are already zero
+        ref = arena->next_slot++;
+    }
+    arena->live_slots++;
+
+    pthread_mutex_unlock(&arena->lock);
+    return ref;
+}
+
+void arena_free(ARENA *arena, NODE_REF ref) {
+    pthread_mutex_lock(&arena->lock);
+    memcpy(arena->base + (size_t)ref * arena->slot_size, &arena->free_list, sizeof(NODE_REF));
+    arena->free_list = ref;
+    arena->live_slots--;
+    pthread_mutex_unlock(&arena->lock);
+}
+
+void arena_reset(ARENA *arena) {
+    if (arena->base != NULL) {
+        // Drop the used pages, they read back as zero. Pages of a shared segment
+        // keep their contents after MADV_DONTNEED, so punch them out of it.
+        madvise(arena->base, (size_t)arena->next_slot * arena->slot_size, g_shm.base ? MADV_REMOVE : MADV_DONTNEED);
+    }
+    arena->next_slot = 1;
+    arena->free_list = 0;
+    arena->live_slots = 0;
+}
+#endif
+
 NODE *alloc_leaf(NODE *parent) {
     NODE *node;
+#ifdef BPTREE_COMPACT_REFS
+    NODE_REF ref;
 
-    if (!(node = (NODE *)calloc(1, sizeof(NODE)))) ERR;
+    // The first allocation sets the arena base, so resolve the ref afterwards
+    ref = arena_alloc(&g_node_arena);
+    node = NODE_AT(ref);
+#else
+    if (g_node_pool.backend == NODE_MEMORY_HUGEPAGE) {
+        node = pool_alloc();
+    } else if (!(node = (NODE *)calloc(1, sizeof(NODE)))) ERR;
+#endif
     node->is_leaf = 1;
-    node->parent = parent;
+    SET_PARENT(node, parent);
     node->num_keys = 0;
 
     return node;
@@ -39,13 +242,74 @@ void clear_node(NODE *node) {
     // Clear all keys and child pointers
     for (i = 0; i < node->num_keys; i++) {
         node->key[i] = 0;
-        node->child[i] = NULL;
+        node->child[i] = NULL_REF;
     }
 
     // Internal nodes have one extra child pointer
     if (node->is_leaf == 0) {
-        node->child[node->num_keys] = NULL;
+        node->child[node->num_keys] = NULL_REF;
     }
 
     node->num_keys = 0;
+}
+
+void free_node(NODE *node) {
+#ifdef BPTREE_BEPSILON
+    buffer_free(node);
+#endif
+#ifdef BPTREE_COMPACT_REFS
+    arena_free(&g_node_arena, NODE_REF_OF(node));
+#else
+    if (g_node_pool.backend == NODE_MEMORY_HUGEPAGE) {
+        pool_free(node);
+    } else {
+        free(node);
+    }
+#endif
+}
+
+void free_tree(NODE *node) {
+    int i;
+
+    if (node == NULL) {
+        return;
+    }
+
+    if (node->is_leaf == 0) {
+        for (i = 0; i < node->num_keys + 1; i++) {
+            free_tree(CHILD(node, i));
+        }
+    } else {
+        // Leaf values are data pointers owned by the caller, or arena copies
+        for (i = 0; i < node->num_keys; i++) {
+            free_data(node->child[i]);
+        }
+    }
+
+    free_node(node);
+}
+
+NODE_REF alloc_data(DATA *data) {
+#ifdef BPTREE_COMPACT_REFS
+    NODE_REF ref;
+
+    if (data == NULL) {
+        return NULL_REF;
+    }
+    ref = arena_alloc(&g_data_arena);
+    *DATA_PTR(ref) = *data;
+    return ref;
+#else
+    return (NODE_REF)data;
+#endif
+}
+
+void free_data(NODE_REF value) {
+#ifdef BPTREE_COMPACT_REFS
+    if (value != NULL_REF) {
+        arena_free(&g_data_arena, value);
+    }
+#else
+    (void)value;
+#endif
 }
\ No newline at end of file
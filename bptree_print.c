@@ -3,11 +3,15 @@
 void bptree_print_core(NODE *node) {
 	int i;
 	
+	if (node->is_leaf == 1) {
+		leaf_sort(node);
+	}
+
 	printf("["); 
 	for (i = 0; i < node->num_keys; i++) {
 		// If internal node, recursively print child subtree first
 		if (node->is_leaf == 0) {
-			bptree_print_core(node->child[i]);
+			bptree_print_core(CHILD(node, i));
 		}
 		printf("%d", node->key[i]);
 		// Add space between keys in leaf nodes only
@@ -17,9 +21,20 @@ void bptree_print_core(NODE *node) {
 	}
 	// Print rightmost child for internal nodes
 	if (node->is_leaf == 0) {
-		bptree_print_core(node->child[node->num_keys]);
+		bptree_print_core(CHILD(node, node->num_keys));
 	}
 	printf("]");
+#ifdef BPTREE_BEPSILON
+	// Pending messages follow their node: {+inserted =upserted -deleted}
+	if (node->is_leaf == 0 && node->num_msgs > 0) {
+		printf("{");
+		for (i = 0; i < node->num_msgs; i++) {
+			printf("%s%c%d", i > 0 ? " " : "",
+			       node->buffer[i].op == MSG_INSERT ? '+' : node->buffer[i].op == MSG_UPSERT ? '=' : '-', node->buffer[i].key);
+		}
+		printf("}");
+	}
+#endif
 }
 
 void bptree_print(NODE *node) {
@@ -0,0 +1,526 @@
+#include <limits.h>
+
+#include "bptree.h"
+
+// Height of a subtree, a single leaf has height 1
+static int tree_height(NODE *node) {
+    int height = 1;
+
+    while (node->is_leaf == 0) {
+        node = CHILD(node, 0);
+        height++;
+    }
+    return height;
+}
+
+// Levels from node up to the root of its tree, node included
+static int levels_up(NODE *node) {
+    int levels = 1;
+
+    while (node->parent != NULL_REF) {
+        node = PARENT(node);
+        levels++;
+    }
+    return levels;
+}
+
+static NODE *find_rightmost_leaf(NODE *node) {
+    while (node->is_leaf == 0) {
+        node = CHILD(node, node->num_keys);
+    }
+    return node;
+}
+
+// Same thresholds as delete_entry
+static int is_underflow(NODE *node) {
+    if (node->is_leaf) {
+        return node->num_keys < (int)ceil((N - 1) / 2.0);
+    }
+    return node->num_keys + 1 < (int)ceil(N / 2.0);
+}
+
+// Spread the entries of children i and i+1 of parent evenly over both
+static void redistribute(NODE *parent, int i) {
+    NODE *left = CHILD(parent, i), *right = CHILD(parent, i + 1);
+    int keys[2 * N];
+    NODE_REF kids[2 * N];
+    int n = 0, m, j;
+
+    if (left->is_leaf == 1) {
+        leaf_sort(left);
+        leaf_sort(right);
+        for (j = 0; j < left->num_keys; j++, n++) {
+            keys[n] = left->key[j];
+            kids[n] = left->child[j];
+        }
+        for (j = 0; j < right->num_keys; j++, n++) {
+            keys[n] = right->key[j];
+            kids[n] = right->child[j];
+        }
+
+        // Next-leaf links in child[N-1] are left alone
+        clear_node(left);
+        clear_node(right);
+        m = n / 2;
+        for (j = 0; j < m; j++) {
+            left->key[j] = keys[j];
+            left->child[j] = kids[j];
+            SET_FINGERPRINT(left, j);
+        }
+        for (j = m; j < n; j++) {
+            right->key[j - m] = keys[j];
+            right->child[j - m] = kids[j];
+            SET_FINGERPRINT(right, j - m);
+        }
+        left->num_keys = m;
+        right->num_keys = n - m;
+        parent->key[i] = right->key[0];
+        return;
+    }
+
+    // Internal: the parent separator sits between the two key runs
+    for (j = 0; j < left->num_keys; j++, n++) {
+        keys[n] = left->key[j];
+        kids[n] = left->child[j];
+    }
+    keys[n] = parent->key[i];
+    kids[n++] = left->child[left->num_keys];
+    for (j = 0; j < right->num_keys; j++, n++) {
+        keys[n] = right->key[j];
+        kids[n] = right->child[j];
+    }
+    kids[n] = right->child[right->num_keys];
+
+    // n keys and n + 1 children, the key after the left half moves up
+    clear_node(left);
+    clear_node(right);
+    m = (n + 1) / 2;
+    for (j = 0; j < m; j++) {
+        left->child[j] = kids[j];
+        SET_PARENT(CHILD(left, j), left);
+        if (j < m - 1) {
+            left->key[j] = keys[j];
+        }
+    }
+    for (j = m; j <= n; j++) {
+        right->child[j - m] = kids[j];
+        SET_PARENT(CHILD(right, j - m), right);
+        if (j < n) {
+            right->key[j - m] = keys[j];
+        }
+    }
+    left->num_keys = m - 1;
+    right->num_keys = n - m;
+    parent->key[i] = keys[m - 1];
+}
+
+// Repair children i and i+1 of parent if either one underflows:
+// merge them when they fit in one node, otherwise share entries evenly
+static void fix_pair(NODE *parent, int i) {
+    NODE *left = CHILD(parent, i), *right = CHILD(parent, i + 1);
+    int sep = parent->key[i];
+
+    if (!is_underflow(left) && !is_underflow(right)) {
+        return;
+    }
+
+    if ((left->is_leaf && left->num_keys + right->num_keys <= N - 1) ||
+        (!left->is_leaf && left->num_keys + right->num_keys + 2 <= N)) {
+        if (left->is_leaf == 0) {
+            left->key[left->num_keys] = sep;
+            left->num_keys++;
+        }
+        merge_node_into_sibling_node(right, left);
+
+        // Drop right from the parent, delete_entry rebalances further up
+        delete_entry(parent, sep, right);
+        free_node(right);
+    } else {
+        redistribute(parent, i);
+    }
+}
+
+NODE *join_tree(NODE *left, int left_height, int sep, NODE *right, int right_height, int *height) {
+    NODE *saved_root = g_root, *node, *child, *parent, *kept;
+    NODE_REF tmp;
+    int h;
+
+    // Empty trees drop out
+    if (left != NULL && left->is_leaf == 1 && left->num_keys == 0) {
+        free_node(left);
+        left = NULL;
+    }
+    if (right != NULL && right->is_leaf == 1 && right->num_keys == 0) {
+        free_node(right);
+        right = NULL;
+    }
+    if (left == NULL || right == NULL) {
+        node = left != NULL ? left : right;
+        if (node != NULL) {
+            node->parent = NULL_REF;
+        }
+        if (height != NULL) {
+            *height = node == NULL ? 0 : left != NULL ? left_height : right_height;
+        }
+        return node;
+    }
+
+    left->parent = NULL_REF;
+    right->parent = NULL_REF;
+    SET_NEXT_LEAF(find_rightmost_leaf(left), find_leftmost_leaf(right));
+
+    // Splits below use the even ratio and treat the grown tree as g_root
+    g_seq_inserts = 0;
+
+    if (left_height == right_height) {
+        // Same height: both roots become children of a new root
+        node = alloc_leaf(NULL);
+        node->is_leaf = 0;
+        node->key[0] = sep;
+        SET_CHILD(node, 0, left);
+        SET_CHILD(node, 1, right);
+        node->num_keys = 1;
+        SET_PARENT(left, node);
+        SET_PARENT(right, node);
+        g_root = node;
+        fix_pair(node, 0);
+        kept = left;
+    } else if (left_height > right_height) {
+        // Graft right onto the right spine of left, one level above its height
+        g_root = left;
+        node = left;
+        for (h = left_height; h > right_height + 1; h--) {
+            node = CHILD(node, node->num_keys);
+        }
+        child = CHILD(node, node->num_keys);
+        SET_PARENT(right, node);
+        insert_in_parent(child, sep, right);
+
+        // right is the last child of its (possibly new) parent
+        parent = PARENT(right);
+        kept = CHILD(parent, parent->num_keys - 1);
+        fix_pair(parent, parent->num_keys - 1);
+    } else {
+        // Graft left onto the left spine of right
+        g_root = right;
+        node = right;
+        for (h = right_height; h > left_height + 1; h--) {
+            node = CHILD(node, 0);
+        }
+        child = CHILD(node, 0);
+        SET_PARENT(left, node);
+        insert_in_parent(child, sep, left);
+
+        // insert_in_parent placed left right after child, swap them
+        parent = PARENT(left);
+        tmp = parent->child[0];
+        parent->child[0] = parent->child[1];
+        parent->child[1] = tmp;
+        fix_pair(parent, 0);
+        kept = left;
+    }
+
+    // fix_pair keeps the left node of the seam, which sits at the lower of the
+    // two heights, so the new height costs no more levels than the graft did
+    if (height != NULL) {
+        *height = (left_height < right_height ? left_height : right_height) - 1 + levels_up(kept);
+    }
+
+    node = g_root;
+    g_root = saved_root;
+    return node;
+}
+
+void split_tree(NODE *root, int key, NODE **left, NODE **right) {
+    NODE *path[MAX_LEVELS];
+    int index[MAX_LEVELS];
+    NODE *node, *piece, *leaf, *new_leaf;
+    int depth = 0, i, j, n, sep, height, left_height = 0, right_height = 0, piece_height;
+
+    *left = NULL;
+    *right = NULL;
+    if (root == NULL) {
+        return;
+    }
+    // Pieces cut at path depth d are height - d or height - d - 1 tall
+    height = tree_height(root);
+
+    // Remember the path to the leftmost leaf that can hold key. Copies of a
+    // separator equal to key may sit left of it, so go left on equality
+    // (as find_leaf_first does), everything right of the path is then >= key.
+    node = root;
+    while (node->is_leaf == 0) {
+        for (i = 0; i < node->num_keys; i++) {
+            if (key <= node->key[i]) {
+                break;
+            }
+        }
+        path[depth] = node;
+        index[depth++] = i;
+        node = CHILD(node, i);
+    }
+
+    // Cut the leaf: keys < key stay, the rest move to a new leaf
+    leaf = node;
+    leaf_sort(leaf);
+    for (j = 0; j < leaf->num_keys; j++) {
+        if (leaf->key[j] >= key) {
+            break;
+        }
+    }
+    if (j < leaf->num_keys) {
+        new_leaf = alloc_leaf(NULL);
+        for (n = 0; j + n < leaf->num_keys; n++) {
+            new_leaf->key[n] = leaf->key[j + n];
+            new_leaf->child[n] = leaf->child[j + n];
+            SET_FINGERPRINT(new_leaf, n);
+            leaf->key[j + n] = 0;
+            leaf->child[j + n] = NULL_REF;
+        }
+        new_leaf->num_keys = n;
+        leaf->num_keys = j;
+        new_leaf->child[N - 1] = leaf->child[N - 1];
+        *right = new_leaf;
+        right_height = 1;
+    }
+    leaf->child[N - 1] = NULL_REF;
+    leaf->parent = NULL_REF;
+    if (leaf->num_keys > 0) {
+        *left = leaf;
+        left_height = 1;
+    } else {
+        free_node(leaf);
+    }
+
+    // Walk back up, joining the siblings on each side of the path
+    while (depth-- > 0) {
+        node = path[depth];
+        i = index[depth];
+
+        // Children right of the path hang after everything gathered so far
+        if (i < node->num_keys) {
+            if (i + 1 == node->num_keys) {
+                piece = CHILD(node, i + 1);
+                piece_height = height - depth - 1;
+            } else {
+                piece = alloc_leaf(NULL);
+                piece->is_leaf = 0;
+                for (j = i + 1; j <= node->num_keys; j++) {
+                    piece->child[j - i - 1] = node->child[j];
+                    SET_PARENT(CHILD(piece, j - i - 1), piece);
+                    if (j < node->num_keys) {
+                        piece->key[j - i - 1] = node->key[j];
+                    }
+                }
+                piece->num_keys = node->num_keys - i - 1;
+                piece_height = height - depth;
+            }
+            *right = join_tree(*right, right_height, node->key[i], piece, piece_height, &right_height);
+        }
+
+        // Children left of the path go in front, node itself keeps them
+        if (i == 0) {
+            free_node(node);
+        } else {
+            sep = node->key[i - 1];
+            if (i == 1) {
+                piece = CHILD(node, 0);
+                piece_height = height - depth - 1;
+                free_node(node);
+            } else {
+                for (j = i - 1; j < node->num_keys; j++) {
+                    node->key[j] = 0;
+                }
+                for (j = i; j <= node->num_keys; j++) {
+                    node->child[j] = NULL_REF;
+                }
+                node->num_keys = i - 1;
+                piece = node;
+                piece_height = height - depth;
+            }
+            *left = join_tree(piece, piece_height, sep, *left, left_height, &left_height);
+        }
+    }
+
+    // The last leaf of the left part still points into the right part
+    if (*left != NULL) {
+        SET_NEXT_LEAF(find_rightmost_leaf(*left), NULL);
+    }
+}
+
+int tree_min_key(NODE *root) {
+    NODE *leaf = find_leftmost_leaf(root);
+
+    leaf_sort(leaf);
+    return leaf->key[0];
+}
+
+// Largest key of a non-empty tree
+static int tree_max_key(NODE *root) {
+    NODE *leaf = find_rightmost_leaf(root);
+
+    leaf_sort(leaf);
+    return leaf->key[leaf->num_keys - 1];
+}
+
+// Point the append hint at the new last leaf after the root changed
+static void reset_root(NODE *root) {
+    g_root = root != NULL ? root : alloc_leaf(NULL);
+    g_rightmost_leaf = find_rightmost_leaf(g_root);
+    g_seq_inserts = 0;
+    g_layer.version++;
+}
+
+void bptree_delete_range(int start_key, int end_key) {
+    NODE *left, *middle, *right = NULL;
+
+    TRACE_OP(TRACE_DELRANGE, start_key, end_key);
+    if (g_root == NULL || start_key > end_key) {
+        return;
+    }
+    bptree_flush();
+
+    // Cut out [start_key, end_key] as a tree of its own and drop it whole
+    split_tree(g_root, start_key, &left, &middle);
+    if (end_key < INT_MAX) {
+        split_tree(middle, end_key + 1, &middle, &right);
+    }
+    if (g_filter.enabled) {
+        filter_remove_tree(middle);
+    }
+    free_tree(middle);
+
+    // end_key + 1 lies between the two remaining parts
+    reset_root(join_tree(left, left != NULL ? tree_height(left) : 0, end_key < INT_MAX ? end_key + 1 : 0,
+                         right, right != NULL ? tree_height(right) : 0, NULL));
+}
+
+NODE *bptree_split(int key) {
+    NODE *left, *right;
+
+    TRACE_OP(TRACE_SPLIT, key, 0);
+    bptree_flush();
+    split_tree(g_root, key, &left, &right);
+    reset_root(left);
+    return right;
+}
+
+int bptree_join(NODE *tree) {
+    if (tree == NULL) {
+        return 0;
+    }
+    bptree_flush();
+    if (tree->is_leaf == 1 && tree->num_keys == 0) {
+        free_node(tree);
+        return 0;
+    }
+    // Replay finds the tree again by its smallest key
+    TRACE_OP(TRACE_JOIN, tree_min_key(tree), 0);
+    if (g_root == NULL || (g_root->is_leaf == 1 && g_root->num_keys == 0)) {
+        if (g_root != NULL) {
+            free_node(g_root);
+        }
+        reset_root(tree);
+        g_filter.stale = 1;
+        return 0;
+    }
+
+    if (tree_max_key(g_root) < tree_min_key(tree)) {
+        reset_root(join_tree(g_root, tree_height(g_root), tree_min_key(tree), tree, tree_height(tree), NULL));
+    } else if (tree_max_key(tree) < tree_min_key(g_root)) {
+        reset_root(join_tree(tree, tree_height(tree), tree_min_key(g_root), g_root, tree_height(g_root), NULL));
+    } else {
+        return -1;
+    }
+    // Keys of the joined tree were never counted into the filter
+    g_filter.stale = 1;
+    return 0;
+}
+
+typedef struct verify_state {
+    int leaf_depth;
+    NODE *prev_leaf;
+    long num_keys;
+} VERIFY_STATE;
+
+// Keys of node must lie in [lo, hi], returns -1 on the first broken invariant.
+// hi is inclusive because duplicates of a separator may end up on its left,
+// the root's bounds come from the caller and are what catch a bad cut.
+// Nodes on the right spine may be underfull, appends leave them that way.
+static int verify_node(NODE *node, NODE *parent, int lo, int hi, int depth, int spine, VERIFY_STATE *state) {
+    int i;
+
+    if (PARENT(node) != parent || node->num_keys < 0 || node->num_keys > N - 1) {
+        return -1;
+    }
+    if (!spine && is_underflow(node)) {
+        return -1;
+    }
+
+    if (node->is_leaf == 1) {
+        if (state->leaf_depth < 0) {
+            state->leaf_depth = depth;
+        }
+        if (depth != state->leaf_depth || (parent != NULL && node->num_keys == 0)) {
+            return -1;
+        }
+        if (state->prev_leaf != NULL && NEXT_LEAF(state->prev_leaf) != node) {
+            return -1;
+        }
+        state->prev_leaf = node;
+
+        for (i = 0; i < node->num_keys; i++) {
+            if (node->key[i] < lo || node->key[i] > hi) {
+                return -1;
+            }
+#ifdef BPTREE_UNSORTED_LEAVES
+            if (node->fp[i] != key_fingerprint(node->key[i])) {
+                return -1;
+            }
+#else
+            if (i > 0 && node->key[i] < node->key[i - 1]) {
+                return -1;
+            }
+#endif
+        }
+        state->num_keys += node->num_keys;
+        return 0;
+    }
+
+    if (node->num_keys < 1) {
+        return -1;
+    }
+#ifdef BPTREE_BEPSILON
+    // Pending messages stay sorted and within the node's key range
+    for (i = 0; i < node->num_msgs; i++) {
+        if (node->buffer[i].key < lo || node->buffer[i].key > hi ||
+            (i > 0 && node->buffer[i].key < node->buffer[i - 1].key)) {
+            return -1;
+        }
+    }
+#endif
+    for (i = 0; i <= node->num_keys; i++) {
+        if (i < node->num_keys && (node->key[i] < lo || node->key[i] > hi ||
+                                   (i > 0 && node->key[i] < node->key[i - 1]))) {
+            return -1;
+        }
+        if (verify_node(CHILD(node, i), node, i > 0 ? node->key[i - 1] : lo,
+                        i < node->num_keys ? node->key[i] : hi, depth + 1, spine && i == node->num_keys, state) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+long bptree_verify(NODE *root, int min_key, int max_key) {
+    VERIFY_STATE state = {-1, NULL, 0};
+
+    if (root == NULL) {
+        return 0;
+    }
+    if (verify_node(root, NULL, min_key, max_key, 0, 1, &state) != 0 ||
+        NEXT_LEAF(state.prev_leaf) != NULL) {
+        return -1;
+    }
+    return state.num_keys;
+}
\ No newline at end of file
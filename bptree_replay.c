@@ -0,0 +1,244 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bptree.h"
+
+// Replays an operation trace recorded with bptree_trace_start against the library
+// Build with optimization, e.g.: make clean && make replay OPT="-O2 -DN=64"
+
+// Busy-wait instead of sleeping when the next operation is this close (original timing)
+#define SPIN_NS 50000ULL
+
+static const char *op_names[TRACE_OPS] = {"insert", "delete", "get", "range", "delrange", "upsert", "unique", "getorins",
+                                         "split", "join"};
+
+// Trees split off during the replay, waiting for the join that attaches them again
+typedef struct detached {
+    NODE **trees;
+    int count;
+    int cap;
+} DETACHED;
+
+// Latencies of one operation type in nanoseconds
+typedef struct latencies {
+    unsigned int *ns;
+    long long count;
+    long long cap;
+} LATENCIES;
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+static void add_latency(LATENCIES *lat, unsigned long long ns) {
+    if (lat->count == lat->cap) {
+        lat->cap = lat->cap ? lat->cap * 2 : 4096;
+        if (!(lat->ns = (unsigned int *)realloc(lat->ns, sizeof(unsigned int) * lat->cap))) ERR;
+    }
+    lat->ns[lat->count++] = ns > 0xFFFFFFFFULL ? 0xFFFFFFFFu : (unsigned int)ns;
+}
+
+static int compare_uint(const void *a, const void *b) {
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void print_latencies(const char *name, LATENCIES *lat) {
+    long long n = lat->count;
+
+    if (n == 0) {
+        return;
+    }
+    qsort(lat->ns, n, sizeof(unsigned int), compare_uint);
+    printf("%-9s %10lld %9u %9u %9u %9u %10u\n", name, n, lat->ns[n / 2], lat->ns[n * 90 / 100],
+           lat->ns[n * 99 / 100], lat->ns[n * 999 / 1000], lat->ns[n - 1]);
+}
+
+static void keep_detached(DETACHED *detached, NODE *tree) {
+    if (tree == NULL) {
+        return;
+    }
+    if (detached->count == detached->cap) {
+        detached->cap = detached->cap ? detached->cap * 2 : 16;
+        if (!(detached->trees = (NODE **)realloc(detached->trees, sizeof(NODE *) * detached->cap))) ERR;
+    }
+    detached->trees[detached->count++] = tree;
+}
+
+// Join the split-off tree whose smallest key is key; returns 0 if there is none.
+// A tree the traced program built some other way cannot be reproduced.
+static int join_detached(DETACHED *detached, int key) {
+    int i;
+
+    for (i = detached->count - 1; i >= 0; i--) {
+        if (tree_min_key(detached->trees[i]) == key) {
+            if (bptree_join(detached->trees[i]) == 0) {
+                detached->trees[i] = detached->trees[--detached->count];
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Sleep until shortly before deadline, then spin so the operation starts on time
+static void wait_until(unsigned long long deadline) {
+    unsigned long long now = now_ns(), wait;
+    struct timespec ts;
+
+    if (now + SPIN_NS < deadline) {
+        wait = deadline - now - SPIN_NS;
+        ts.tv_sec = (time_t)(wait / 1000000000ULL);
+        ts.tv_nsec = (long)(wait % 1000000000ULL);
+        nanosleep(&ts, NULL);
+    }
+    while (now_ns() < deadline) {
+    }
+}
+
+static void show_usage(void) {
+    printf("Usage: bptree-replay [-t] [-l snapshot] <trace>\n");
+    printf("  -t           keep the original timing between operations (default: full speed)\n");
+    printf("  -l snapshot  load a snapshot written by bptree_save before replaying\n");
+}
+
+int main(int argc, char *argv[]) {
+    LATENCIES lat[TRACE_OPS];
+    DETACHED detached;
+    TRACE_READER reader;
+    TRACE_RECORD rec;
+    AGGREGATE agg;
+    STATS stats;
+    DATA *data;
+    const char *snapshot = NULL, *path = NULL;
+    unsigned long long start, begin, end, lag, max_lag = 0;
+    long long total = 0, lost_joins = 0;
+    int timed = 0, i, ret;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0) {
+            timed = 1;
+        } else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+            snapshot = argv[++i];
+        } else if (path == NULL && argv[i][0] != '-') {
+            path = argv[i];
+        } else {
+            show_usage();
+            return 1;
+        }
+    }
+    if (path == NULL) {
+        show_usage();
+        return 1;
+    }
+
+    bptree_init();
+    if (snapshot != NULL && bptree_load(snapshot, 1) != 0) {
+        perror(snapshot);
+        return 1;
+    }
+    if (bptree_trace_open(&reader, path) != 0) {
+        perror(path);
+        return 1;
+    }
+    memset(lat, 0, sizeof(lat));
+    memset(&detached, 0, sizeof(detached));
+    bptree_stats_reset();
+
+    printf("replay: %s sample=%.6g timing=%s N=%d\n", path, reader.sample_rate, timed ? "original" : "full speed", N);
+
+    start = now_ns();
+    while ((ret = bptree_trace_next(&reader, &rec)) == 1) {
+        if (timed) {
+            wait_until(start + rec.time_ns);
+        }
+
+        begin = now_ns();
+        switch (rec.op) {
+        case TRACE_INSERT:
+            bptree_insert(rec.key, NULL);
+            break;
+        case TRACE_DELETE:
+            bptree_delete(rec.key);
+            break;
+        case TRACE_GET:
+            bptree_get(rec.key, &data);
+            break;
+        case TRACE_RANGE:
+            // Same leaf walk as a scan, without printing every key
+            bptree_parallel_aggregate(rec.key, rec.arg, 1, &agg);
+            break;
+        case TRACE_DELRANGE:
+            bptree_delete_range(rec.key, rec.arg);
+            break;
+        case TRACE_UPSERT:
+            bptree_upsert(rec.key, NULL);
+            break;
+        case TRACE_INSERT_UNIQUE:
+            bptree_insert_unique(rec.key, NULL);
+            break;
+        case TRACE_GET_OR_INSERT:
+            bptree_get_or_insert(rec.key, NULL, &data);
+            break;
+        case TRACE_SPLIT:
+            keep_detached(&detached, bptree_split(rec.key));
+            break;
+        case TRACE_JOIN:
+            lost_joins += !join_detached(&detached, rec.key);
+            break;
+        }
+        end = now_ns();
+
+        add_latency(&lat[rec.op], end - begin);
+        if (timed && begin > start + rec.time_ns) {
+            lag = begin - (start + rec.time_ns);
+            if (lag > max_lag) {
+                max_lag = lag;
+            }
+        }
+        total++;
+    }
+    end = now_ns();
+    if (ret < 0) {
+        fprintf(stderr, "%s: truncated or corrupt after %lld records\n", path, total);
+    }
+    if (lost_joins > 0) {
+        fprintf(stderr, "warning: %lld joins attach a tree that was not split off in this trace, "
+                        "they were skipped and the tree differs from the recorded one\n", lost_joins);
+    }
+
+    printf("%-9s %10s %9s %9s %9s %9s %10s\n", "op", "count", "p50 ns", "p90 ns", "p99 ns", "p99.9 ns", "max ns");
+    for (i = 0; i < TRACE_OPS; i++) {
+        print_latencies(op_names[i], &lat[i]);
+        free(lat[i].ns);
+    }
+    printf("total: %lld ops in %.3f s (%.2f Mops/s)\n", total, (end - start) / 1e9,
+           total / ((end - start) / 1e9) / 1e6);
+    if (timed) {
+        printf("max behind schedule: %.1f us\n", max_lag / 1e3);
+    }
+
+    bptree_stats(&stats);
+    printf("splits: leaf %lld internal %lld root %lld\n", stats.counters.leaf_splits,
+           stats.counters.internal_splits, stats.counters.root_splits);
+    printf("merges: leaf %lld internal %lld, borrows: leaf %lld internal %lld, root shrinks %lld\n",
+           stats.counters.leaf_merges, stats.counters.internal_merges, stats.counters.leaf_borrows,
+           stats.counters.internal_borrows, stats.counters.root_shrinks);
+    printf("tree: %lld keys, height %d\n", stats.num_keys, stats.height);
+
+    bptree_trace_close(&reader);
+    for (i = 0; i < detached.count; i++) {
+        free_tree(detached.trees[i]);
+    }
+    free(detached.trees);
+    bptree_destroy();
+    return ret < 0 ? 1 : 0;
+}
\ No newline at end of file
@@ -1,13 +1,22 @@
+#include <limits.h>
+
 #include "bptree.h"
 
 void bptree_scan_all(void) {
     NODE *current_leaf;
     int i;
 
+    TRACE_OP(TRACE_RANGE, INT_MIN, INT_MAX);
     if (g_root == NULL) {
         printf("RESULT: \n");
         return;
     }
+#ifdef BPTREE_BEPSILON
+    if (g_root->is_leaf == 0) {
+        buffer_scan_range(INT_MIN, INT_MAX);
+        return;
+    }
+#endif
 
     // Start from leftmost leaf
     current_leaf = find_leftmost_leaf(g_root);
@@ -18,12 +27,13 @@ void bptree_scan_all(void) {
     // Traverse all leaf nodes using next leaf pointers
     while (current_leaf != NULL) {
         // Print all keys in current leaf
+        leaf_sort(current_leaf);
         for (i = 0; i < current_leaf->num_keys; i++) {
             printf("%d ", current_leaf->key[i]);
         }
         
         // Move to next leaf via child[N-1]
-        current_leaf = current_leaf->child[N - 1];
+        current_leaf = NEXT_LEAF(current_leaf);
     }
 
     printf("\n");
@@ -34,10 +44,17 @@ void bptree_scan_range(int start_key, int end_key) {
     int i;
     int found_start = 0;
 
+    TRACE_OP(TRACE_RANGE, start_key, end_key);
     if (g_root == NULL) {
         printf("RESULT: \n");
         return;
     }
+#ifdef BPTREE_BEPSILON
+    if (g_root->is_leaf == 0) {
+        buffer_scan_range(start_key, end_key);
+        return;
+    }
+#endif
 
     // Start from leftmost leaf
     current_leaf = find_leftmost_leaf(g_root);
@@ -48,6 +65,7 @@ void bptree_scan_range(int start_key, int end_key) {
     // Traverse leaf nodes using next leaf pointers
     while (current_leaf != NULL) {
         // Check all keys in current leaf
+        leaf_sort(current_leaf);
         for (i = 0; i < current_leaf->num_keys; i++) {
             int key = current_leaf->key[i];
             
@@ -69,7 +87,7 @@ void bptree_scan_range(int start_key, int end_key) {
         }
         
         // Move to next leaf via child[N-1]
-        current_leaf = current_leaf->child[N - 1];
+        current_leaf = NEXT_LEAF(current_leaf);
     }
     
     printf("\n");
@@ -0,0 +1,256 @@
+#include <pthread.h>
+#include <string.h>
+
+#include "bptree.h"
+
+// Sub-ranges handed out per worker, more than one so fast workers can take extra
+#define TASKS_PER_THREAD 8
+
+// One sub-range [start, end) of the key space
+typedef struct scan_task {
+    long long start;
+    long long end;
+    AGGREGATE agg;
+    int *keys;          // collected keys (NULL when only aggregating)
+    int num_keys;
+    int cap_keys;
+} SCAN_TASK;
+
+// Shared state of one parallel scan, workers pull tasks from next_task
+typedef struct scan_ctx {
+    SCAN_TASK *tasks;
+    int num_tasks;
+    int next_task;
+    int collect;
+    pthread_mutex_t lock;
+} SCAN_CTX;
+
+#ifdef BPTREE_UNSORTED_LEAVES
+static int compare_int(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+#endif
+
+static void scan_task_run(SCAN_TASK *task, int collect) {
+    NODE *leaf;
+    int i, key, past_end = 0;
+
+    task->agg.count = 0;
+    task->agg.sum = 0;
+
+    // Leaves are only read here, neighbouring tasks may share a boundary leaf,
+    // so every key of a leaf is checked instead of relying on leaf order.
+    // Copies of task->start may lie left of an equal separator, start there.
+    leaf = find_leaf_first(g_root, (int)task->start);
+    while (leaf != NULL && !past_end) {
+        for (i = 0; i < leaf->num_keys; i++) {
+            key = leaf->key[i];
+            if (key < task->start) {
+                continue;
+            }
+            if (key >= task->end) {
+                past_end = 1;
+                continue;
+            }
+
+            if (task->agg.count == 0 || key < task->agg.min) {
+                task->agg.min = key;
+            }
+            if (task->agg.count == 0 || key > task->agg.max) {
+                task->agg.max = key;
+            }
+            task->agg.count++;
+            task->agg.sum += key;
+
+            if (collect) {
+                if (task->num_keys == task->cap_keys) {
+                    task->cap_keys = task->cap_keys ? task->cap_keys * 2 : 1024;
+                    if (!(task->keys = (int *)realloc(task->keys, sizeof(int) * task->cap_keys))) ERR;
+                }
+                task->keys[task->num_keys++] = key;
+            }
+        }
+
+        // Move to next leaf via child[N-1]
+        leaf = NEXT_LEAF(leaf);
+    }
+
+#ifdef BPTREE_UNSORTED_LEAVES
+    if (collect && task->num_keys > 1) {
+        qsort(task->keys, task->num_keys, sizeof(int), compare_int);
+    }
+#endif
+}
+
+static void *scan_worker(void *arg) {
+    SCAN_CTX *ctx = (SCAN_CTX *)arg;
+    int i;
+
+    while (1) {
+        pthread_mutex_lock(&ctx->lock);
+        i = ctx->next_task++;
+        pthread_mutex_unlock(&ctx->lock);
+
+        if (i >= ctx->num_tasks) {
+            break;
+        }
+        scan_task_run(&ctx->tasks[i], ctx->collect);
+    }
+
+    return NULL;
+}
+
+// Collect separator keys inside (start_key, end_key] from the upper levels,
+// descending until there are enough boundaries or the next level is leaves
+static int collect_boundaries(int start_key, int end_key, int target, int **boundaries) {
+    NODE **level, **next;
+    int num_level, num_next, num_bounds = 0, cap;
+    int i, j;
+
+    if (!(level = (NODE **)malloc(sizeof(NODE *)))) ERR;
+    level[0] = g_root;
+    num_level = 1;
+    *boundaries = NULL;
+
+    while (level[0]->is_leaf == 0) {
+        // Separators of this level that fall inside the range
+        free(*boundaries);
+        cap = num_level * (N - 1);
+        if (!(*boundaries = (int *)malloc(sizeof(int) * cap))) ERR;
+        num_bounds = 0;
+        for (i = 0; i < num_level; i++) {
+            for (j = 0; j < level[i]->num_keys; j++) {
+                if (level[i]->key[j] > start_key && level[i]->key[j] <= end_key) {
+                    (*boundaries)[num_bounds++] = level[i]->key[j];
+                }
+            }
+        }
+
+        if (num_bounds >= target || CHILD(level[0], 0)->is_leaf == 1) {
+            break;
+        }
+
+        // Descend into the children that overlap the range
+        if (!(next = (NODE **)malloc(sizeof(NODE *) * num_level * N))) ERR;
+        num_next = 0;
+        for (i = 0; i < num_level; i++) {
+            for (j = 0; j <= level[i]->num_keys; j++) {
+                if (j > 0 && level[i]->key[j - 1] > end_key) {
+                    break;
+                }
+                if (j < level[i]->num_keys && level[i]->key[j] <= start_key) {
+                    continue;
+                }
+                next[num_next++] = CHILD(level[i], j);
+            }
+        }
+        free(level);
+        level = next;
+        num_level = num_next;
+    }
+
+    free(level);
+    return num_bounds;
+}
+
+// Split [start_key, end_key] at separator keys and scan the pieces in parallel
+static SCAN_TASK *parallel_scan(int start_key, int end_key, int num_threads, int collect, int *num_tasks) {
+    pthread_t threads[MAX_BULK_THREADS];
+    SCAN_CTX ctx;
+    int *boundaries;
+    int num_bounds, t;
+
+    if (num_threads < 1) {
+        num_threads = 1;
+    } else if (num_threads > MAX_BULK_THREADS) {
+        num_threads = MAX_BULK_THREADS;
+    }
+
+    num_bounds = collect_boundaries(start_key, end_key, num_threads * TASKS_PER_THREAD, &boundaries);
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.num_tasks = num_bounds + 1;
+    ctx.collect = collect;
+    if (!(ctx.tasks = (SCAN_TASK *)calloc(ctx.num_tasks, sizeof(SCAN_TASK)))) ERR;
+
+    // Boundaries come out of a left-to-right level walk, so they are sorted
+    for (t = 0; t < ctx.num_tasks; t++) {
+        ctx.tasks[t].start = t == 0 ? start_key : boundaries[t - 1];
+        ctx.tasks[t].end = t == num_bounds ? (long long)end_key + 1 : boundaries[t];
+    }
+    free(boundaries);
+
+    pthread_mutex_init(&ctx.lock, NULL);
+    for (t = 1; t < num_threads; t++) {
+        if (pthread_create(&threads[t], NULL, scan_worker, &ctx) != 0) ERR;
+    }
+    scan_worker(&ctx);
+    for (t = 1; t < num_threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    pthread_mutex_destroy(&ctx.lock);
+
+    *num_tasks = ctx.num_tasks;
+    return ctx.tasks;
+}
+
+void bptree_parallel_aggregate(int start_key, int end_key, int num_threads, AGGREGATE *result) {
+    SCAN_TASK *tasks;
+    int num_tasks, i;
+
+    TRACE_OP(TRACE_RANGE, start_key, end_key);
+    memset(result, 0, sizeof(AGGREGATE));
+    if (g_root == NULL || start_key > end_key) {
+        return;
+    }
+    bptree_flush();
+
+    tasks = parallel_scan(start_key, end_key, num_threads, 0, &num_tasks);
+
+    // Combine partial aggregates
+    for (i = 0; i < num_tasks; i++) {
+        if (tasks[i].agg.count == 0) {
+            continue;
+        }
+        if (result->count == 0 || tasks[i].agg.min < result->min) {
+            result->min = tasks[i].agg.min;
+        }
+        if (result->count == 0 || tasks[i].agg.max > result->max) {
+            result->max = tasks[i].agg.max;
+        }
+        result->count += tasks[i].agg.count;
+        result->sum += tasks[i].agg.sum;
+    }
+
+    free(tasks);
+}
+
+int bptree_parallel_range(int start_key, int end_key, int num_threads, int *keys, int max_keys) {
+    SCAN_TASK *tasks;
+    int num_tasks, i, n, written = 0;
+
+    TRACE_OP(TRACE_RANGE, start_key, end_key);
+    if (g_root == NULL || start_key > end_key) {
+        return 0;
+    }
+    bptree_flush();
+
+    tasks = parallel_scan(start_key, end_key, num_threads, 1, &num_tasks);
+
+    // Tasks cover consecutive sub-ranges, so concatenating keeps keys in order
+    for (i = 0; i < num_tasks; i++) {
+        n = tasks[i].num_keys;
+        if (n > max_keys - written) {
+            n = max_keys - written;
+        }
+        if (n > 0) {
+            memcpy(keys + written, tasks[i].keys, sizeof(int) * n);
+            written += n;
+        }
+        free(tasks[i].keys);
+    }
+
+    free(tasks);
+    return written;
+}
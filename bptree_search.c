@@ -0,0 +1,121 @@
+#include "bptree.h"
+
+// Maximum number of lookups advanced together by bptree_multi_get
+#define MULTI_GET_GROUP 64
+
+#define CACHE_LINE 64
+
+// Ask for every cache line of a node ahead of time
+static void prefetch_node(NODE *node) {
+    const char *p = (const char *)node;
+    size_t offset;
+
+    for (offset = 0; offset < sizeof(NODE); offset += CACHE_LINE) {
+        __builtin_prefetch(p + offset);
+    }
+}
+
+int bptree_get(int key, DATA **data) {
+    NODE *leaf;
+    int i;
+
+    TRACE_OP(TRACE_GET, key, 0);
+    if (g_root == NULL || FILTER_MISS(key)) {
+        return 0;
+    }
+#ifdef BPTREE_BEPSILON
+    if (g_root->is_leaf == 0) {
+        return buffer_get(key, data);
+    }
+#endif
+
+    leaf = find_leaf_first(LAYER_START(key), key);
+    i = leaf_find_first(&leaf, key);
+    if (i < 0) {
+        return 0;
+    }
+
+    if (data != NULL) {
+        *data = LEAF_DATA(leaf, i);
+    }
+    return 1;
+}
+
+int bptree_multi_get(const int *keys, int count, DATA **out) {
+    NODE *nodes[MULTI_GET_GROUP];
+    NODE *level, *start;
+    int base, size, i, kid, slot, found = 0;
+
+    for (i = 0; i < count; i++) {
+        TRACE_OP(TRACE_GET, keys[i], 0);
+    }
+
+#ifdef BPTREE_BEPSILON
+    // Each lookup has to replay the buffers on its own path
+    if (g_root != NULL && g_root->is_leaf == 0) {
+        for (i = 0; i < count; i++) {
+            if (FILTER_MISS(keys[i]) || !buffer_get(keys[i], &out[i])) {
+                out[i] = NULL;
+            } else {
+                found++;
+            }
+        }
+        return found;
+    }
+#endif
+
+    for (base = 0; base < count; base += MULTI_GET_GROUP) {
+        size = count - base < MULTI_GET_GROUP ? count - base : MULTI_GET_GROUP;
+
+        if (g_root == NULL) {
+            for (i = 0; i < size; i++) {
+                out[base + i] = NULL;
+            }
+            continue;
+        }
+
+        // Keys the filter rules out drop out of the group before the descent.
+        // With an up-to-date search layer every lookup starts at the level below it.
+        start = LAYER_START(keys[base]);
+        for (i = 0; i < size; i++) {
+            if (FILTER_MISS(keys[base + i])) {
+                nodes[i] = NULL;
+            } else {
+                nodes[i] = start == g_root ? g_root : layer_find(keys[base + i]);
+            }
+            if (nodes[i] != NULL && nodes[i] != start) {
+                prefetch_node(nodes[i]);
+            }
+        }
+
+        // All leaves are at the same depth, so the group moves level by level.
+        // Each lookup's next node is prefetched while the others are processed.
+        // Like find_leaf_first it goes left on equality to reach every duplicate.
+        for (level = start; level->is_leaf == 0; level = CHILD(level, 0)) {
+            for (i = 0; i < size; i++) {
+                if (nodes[i] == NULL) {
+                    continue;
+                }
+                for (kid = 0; kid < nodes[i]->num_keys; kid++) {
+                    if (keys[base + i] <= nodes[i]->key[kid]) {
+                        break;
+                    }
+                }
+                nodes[i] = NODE_AT(nodes[i]->child[kid]);
+                prefetch_node(nodes[i]);
+            }
+        }
+
+        for (i = 0; i < size; i++) {
+            slot = nodes[i] != NULL ? leaf_find_first(&nodes[i], keys[base + i]) : -1;
+            if (slot < 0) {
+                out[base + i] = NULL;
+            } else {
+                out[base + i] = LEAF_DATA(nodes[i], slot);
+                found++;
+            }
+        }
+    }
+
+    return found;
+}
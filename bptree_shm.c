@@ -0,0 +1,354 @@
+#define _DEFAULT_SOURCE
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bptree.h"
+
+#ifdef BPTREE_COMPACT_REFS
+// Segment layout: SHM_HEADER padded to SHM_HEADER_SIZE, the node arena, the data arena.
+// The segment is sized for both reservations up front; tmpfs only backs touched pages.
+//
+// Readers follow the seqlock in the header: read seq, walk the tree, and start over
+// if seq was odd or changed meanwhile. A reader can see a node half rewritten, so
+// every reference and key count is checked before use and the walk gives up early
+// instead of following garbage.
+#define SHM_MAGIC 0x4d485342u           // "BSHM"
+#define SHM_VERSION 1
+#define SHM_SIZE (SHM_HEADER_SIZE + 2 * (size_t)ARENA_RESERVE)
+
+SHM g_shm = { NULL, 0, -1, NULL, "" };
+
+int bptree_shm_create(const char *name) {
+    char *base;
+    int fd;
+
+    if (g_shm.base != NULL || (g_root != NULL && (g_root->is_leaf == 0 || g_root->num_keys > 0))) {
+        errno = EBUSY;
+        return -1;
+    }
+    if (strlen(name) >= sizeof(g_shm.name)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    if ((fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+        return -1;
+    }
+    if (ftruncate(fd, (off_t)SHM_SIZE) != 0) {
+        close(fd);
+        shm_unlink(name);
+        return -1;
+    }
+    base = (char *)mmap(NULL, SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, fd, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        shm_unlink(name);
+        return -1;
+    }
+
+    // Drop the private arenas, the tree restarts empty in the segment
+    bptree_destroy();
+    if (g_node_arena.base != NULL) {
+        munmap(g_node_arena.base, ARENA_RESERVE);
+    }
+    if (g_data_arena.base != NULL) {
+        munmap(g_data_arena.base, ARENA_RESERVE);
+    }
+    g_node_arena.base = base + SHM_HEADER_SIZE;
+    g_node_arena.max_slots = ARENA_RESERVE / sizeof(NODE) > 0xffffffffu ? 0xffffffffu
+                                                                        : (unsigned int)(ARENA_RESERVE / sizeof(NODE));
+    g_data_arena.base = base + SHM_HEADER_SIZE + ARENA_RESERVE;
+    g_data_arena.max_slots = ARENA_RESERVE / sizeof(DATA) > 0xffffffffu ? 0xffffffffu
+                                                                        : (unsigned int)(ARENA_RESERVE / sizeof(DATA));
+
+    g_shm.base = base;
+    g_shm.size = SHM_SIZE;
+    g_shm.fd = fd;
+    g_shm.header = (SHM_HEADER *)base;
+    strcpy(g_shm.name, name);
+
+    g_shm.header->order = N;
+    g_shm.header->node_size = sizeof(NODE);
+    g_shm.header->data_size = sizeof(DATA);
+    g_shm.header->root = NULL_REF;
+    g_shm.header->node_slots = 1;
+    g_shm.header->data_slots = 1;
+    g_shm.header->version = SHM_VERSION;
+    // Readers check the magic last
+    __atomic_store_n(&g_shm.header->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int bptree_shm_destroy(void) {
+    int ret;
+
+    if (g_shm.base == NULL) {
+        return 0;
+    }
+    bptree_destroy();
+    munmap(g_shm.base, g_shm.size);
+    close(g_shm.fd);
+    ret = shm_unlink(g_shm.name);
+
+    // The arenas reserve private memory again on next use
+    g_node_arena.base = NULL;
+    g_data_arena.base = NULL;
+    memset(&g_shm, 0, sizeof(g_shm));
+    g_shm.fd = -1;
+    return ret;
+}
+
+void bptree_shm_write_begin(void) {
+    if (g_shm.header == NULL) {
+        return;
+    }
+    __atomic_store_n(&g_shm.header->seq, g_shm.header->seq + 1, __ATOMIC_RELAXED);
+    // The odd seq has to be visible before any node changes
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void bptree_shm_write_end(void) {
+    SHM_HEADER *header = g_shm.header;
+
+    if (header == NULL) {
+        return;
+    }
+#ifdef BPTREE_BEPSILON
+    // Readers only look at the leaves
+    bptree_flush();
+#endif
+    header->root = NODE_REF_OF(g_root);
+    header->node_slots = g_node_arena.next_slot;
+    header->data_slots = g_data_arena.next_slot;
+    __atomic_store_n(&header->seq, header->seq + 1, __ATOMIC_RELEASE);
+}
+
+int bptree_shm_open(SHM_READER *reader, const char *name) {
+    const SHM_HEADER *header;
+    struct stat st;
+    void *base;
+    int fd;
+
+    memset(reader, 0, sizeof(SHM_READER));
+    if ((fd = shm_open(name, O_RDONLY, 0)) < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    if ((size_t)st.st_size != SHM_SIZE) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    base = mmap(NULL, SHM_SIZE, PROT_READ, MAP_SHARED | MAP_NORESERVE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return -1;
+    }
+
+    header = (const SHM_HEADER *)base;
+    if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC || header->version != SHM_VERSION ||
+        header->order != N || header->node_size != sizeof(NODE) || header->data_size != sizeof(DATA)) {
+        munmap(base, SHM_SIZE);
+        errno = EINVAL;
+        return -1;
+    }
+
+    reader->header = header;
+    reader->nodes = (const char *)base + SHM_HEADER_SIZE;
+    reader->data = (const char *)base + SHM_HEADER_SIZE + ARENA_RESERVE;
+    reader->size = SHM_SIZE;
+    return 0;
+}
+
+void bptree_shm_close(SHM_READER *reader) {
+    if (reader->header != NULL) {
+        munmap((void *)reader->header, reader->size);
+    }
+    memset(reader, 0, sizeof(SHM_READER));
+}
+
+// Wait until no write section is open and return the seq to validate against
+static unsigned long long read_begin(const SHM_READER *reader) {
+    unsigned long long seq;
+
+    while ((seq = __atomic_load_n(&reader->header->seq, __ATOMIC_ACQUIRE)) & 1) {
+        sched_yield();
+    }
+    return seq;
+}
+
+// Nonzero if the writer left everything read since read_begin alone
+static int read_valid(const SHM_READER *reader, unsigned long long seq) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&reader->header->seq, __ATOMIC_RELAXED) == seq;
+}
+
+// Node behind a reference, NULL if the reference cannot be a published node
+static const NODE *shm_node(const SHM_READER *reader, NODE_REF ref, unsigned int slots) {
+    if (ref == NULL_REF || ref >= slots) {
+        return NULL;
+    }
+    return (const NODE *)(reader->nodes + (size_t)ref * sizeof(NODE));
+}
+
+// Key count of a node, -1 if it is out of range (node caught mid-change)
+static int shm_num_keys(const NODE *node) {
+    int num_keys = __atomic_load_n(&node->num_keys, __ATOMIC_RELAXED);
+
+    return num_keys >= 0 && num_keys <= N - 1 ? num_keys : -1;
+}
+
+// Descend to the leftmost leaf that can hold key, going left on equality like
+// find_leaf_first; 1 with *leaf set, 0 for an empty tree, -1 if torn
+static int shm_find_leaf(const SHM_READER *reader, int key, unsigned int slots, const NODE **leaf) {
+    NODE_REF ref = __atomic_load_n(&reader->header->root, __ATOMIC_RELAXED);
+    const NODE *node;
+    int depth, num_keys, kid;
+
+    if (ref == NULL_REF) {
+        return 0;
+    }
+    for (depth = 0; depth < MAX_LEVELS; depth++) {
+        if ((node = shm_node(reader, ref, slots)) == NULL || (num_keys = shm_num_keys(node)) < 0) {
+            return -1;
+        }
+        if (node->is_leaf) {
+            *leaf = node;
+            return 1;
+        }
+        for (kid = 0; kid < num_keys; kid++) {
+            if (key <= node->key[kid]) {
+                break;
+            }
+        }
+        ref = __atomic_load_n(&node->child[kid], __ATOMIC_RELAXED);
+    }
+    return -1;
+}
+
+// One lookup attempt: 1 found, 0 not found, -1 if it has to be repeated
+static int shm_lookup(const SHM_READER *reader, int key, DATA *data) {
+    unsigned int node_slots = __atomic_load_n(&reader->header->node_slots, __ATOMIC_RELAXED);
+    unsigned int data_slots = __atomic_load_n(&reader->header->data_slots, __ATOMIC_RELAXED);
+    const NODE *leaf;
+    NODE_REF value;
+    int ret, num_keys, i, above, hop;
+
+    if ((ret = shm_find_leaf(reader, key, node_slots, &leaf)) <= 0) {
+        return ret;
+    }
+    // Every key is compared, which works for sorted and unsorted leaves alike.
+    // Unless the leaf holds a larger key, the first copy may open the next leaf.
+    for (hop = 0;; hop++) {
+        if ((num_keys = shm_num_keys(leaf)) < 0) {
+            return -1;
+        }
+        for (i = 0, above = 0; i < num_keys; i++) {
+            if (leaf->key[i] == key) {
+                break;
+            }
+            above |= leaf->key[i] > key;
+        }
+        if (i < num_keys) {
+            break;
+        }
+        if (above || hop > 0) {
+            return 0;
+        }
+        leaf = shm_node(reader, __atomic_load_n(&leaf->child[N - 1], __ATOMIC_RELAXED), node_slots);
+        if (leaf == NULL) {
+            return 0;
+        }
+    }
+    if (data != NULL) {
+        value = __atomic_load_n(&leaf->child[i], __ATOMIC_RELAXED);
+        if (value >= data_slots) {
+            return -1;
+        }
+        if (value == NULL_REF) {
+            memset(data, 0, sizeof(DATA));
+        } else {
+            memcpy(data, reader->data + (size_t)value * sizeof(DATA), sizeof(DATA));
+        }
+    }
+    return 1;
+}
+
+int bptree_shm_get(SHM_READER *reader, int key, DATA *data) {
+    unsigned long long seq;
+    int found;
+
+    for (;;) {
+        seq = read_begin(reader);
+        found = shm_lookup(reader, key, data);
+        if (found >= 0 && read_valid(reader, seq)) {
+            return found;
+        }
+        reader->retries++;
+    }
+}
+
+// One aggregate attempt over the leaf chain: 0 on success, -1 if it has to be repeated
+static int shm_aggregate(const SHM_READER *reader, unsigned long long seq, int start_key, int end_key,
+                         AGGREGATE *agg) {
+    unsigned int slots = __atomic_load_n(&reader->header->node_slots, __ATOMIC_RELAXED);
+    const NODE *leaf;
+    unsigned int visited;
+    int ret, num_keys, past_end = 0, i, key;
+
+    memset(agg, 0, sizeof(AGGREGATE));
+    if ((ret = shm_find_leaf(reader, start_key, slots, &leaf)) <= 0) {
+        return ret;
+    }
+
+    // Like bptree_parallel_aggregate, every key of a leaf is checked and the walk
+    // stops after the first leaf holding a key past the range
+    for (visited = 0; leaf != NULL && !past_end; visited++) {
+        // A cycle or a long walk through a changing tree is cut short here
+        if (visited >= slots || !read_valid(reader, seq) || (num_keys = shm_num_keys(leaf)) < 0) {
+            return -1;
+        }
+        for (i = 0; i < num_keys; i++) {
+            key = leaf->key[i];
+            if (key < start_key) {
+                continue;
+            }
+            if (key > end_key) {
+                past_end = 1;
+                continue;
+            }
+            if (agg->count == 0 || key < agg->min) {
+                agg->min = key;
+            }
+            if (agg->count == 0 || key > agg->max) {
+                agg->max = key;
+            }
+            agg->count++;
+            agg->sum += key;
+        }
+        leaf = shm_node(reader, __atomic_load_n(&leaf->child[N - 1], __ATOMIC_RELAXED), slots);
+    }
+    return 0;
+}
+
+void bptree_shm_aggregate(SHM_READER *reader, int start_key, int end_key, AGGREGATE *result) {
+    unsigned long long seq;
+
+    for (;;) {
+        seq = read_begin(reader);
+        if (shm_aggregate(reader, seq, start_key, end_key, result) == 0 && read_valid(reader, seq)) {
+            return;
+        }
+        reader->retries++;
+    }
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,334 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "bptree.h"
+
+// Snapshot file layout (host byte order):
+//   SNAPSHOT_HEADER
+//   blocks of up to SNAPSHOT_BLOCK_KEYS entries in key order, each one
+//     BLOCK_HEADER, then the payload:
+//       keys    int32[n], or with SNAPSHOT_COMPRESSED the first key as a
+//               zigzag varint followed by varint deltas
+//       present bitmap of n bits, set when the entry has data
+//       values  sizeof(DATA) bytes for every present entry
+#define SNAPSHOT_MAGIC 0x53545042u      // "BPTS"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_COMPRESSED 0x1
+#define SNAPSHOT_BLOCK_KEYS 65536
+#define SNAPSHOT_IO_BUFFER (1 << 22)
+
+typedef struct snapshot_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t data_size;         // sizeof(DATA) of the writer
+    uint64_t num_keys;
+} SNAPSHOT_HEADER;
+
+typedef struct block_header {
+    uint32_t num_keys;
+    uint32_t payload_size;
+    uint32_t crc;               // CRC-32 of the payload
+} BLOCK_HEADER;
+
+// Data owned by the tree since the last bptree_load (pointer layout only)
+DATA *g_loaded_data = NULL;
+
+// Slicing-by-8 tables, crc_table[0] is the classic byte-at-a-time table
+static uint32_t crc_table[8][256];
+
+static void crc_init(void) {
+    uint32_t c;
+    int i, j;
+
+    if (crc_table[0][1] != 0) {
+        return;
+    }
+    for (i = 0; i < 256; i++) {
+        c = (uint32_t)i;
+        for (j = 0; j < 8; j++) {
+            c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        crc_table[0][i] = c;
+    }
+    for (i = 0; i < 256; i++) {
+        for (j = 1; j < 8; j++) {
+            crc_table[j][i] = (crc_table[j - 1][i] >> 8) ^ crc_table[0][crc_table[j - 1][i] & 0xFF];
+        }
+    }
+}
+
+static uint32_t load_le32(const unsigned char *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// CRC-32 (IEEE), eight bytes per step so checksumming keeps up with the disk
+static uint32_t crc32(const unsigned char *buf, size_t len) {
+    uint32_t c = 0xFFFFFFFFu, hi;
+
+    for (; len >= 8; len -= 8, buf += 8) {
+        c ^= load_le32(buf);
+        hi = load_le32(buf + 4);
+        c = crc_table[7][c & 0xFF] ^ crc_table[6][(c >> 8) & 0xFF] ^
+            crc_table[5][(c >> 16) & 0xFF] ^ crc_table[4][c >> 24] ^
+            crc_table[3][hi & 0xFF] ^ crc_table[2][(hi >> 8) & 0xFF] ^
+            crc_table[1][(hi >> 16) & 0xFF] ^ crc_table[0][hi >> 24];
+    }
+    for (; len > 0; len--, buf++) {
+        c = crc_table[0][(c ^ *buf) & 0xFF] ^ (c >> 8);
+    }
+    return c ^ 0xFFFFFFFFu;
+}
+
+// Upper bound on the payload of a block of n entries
+static size_t block_bound(int n) {
+    return (size_t)n * (5 + sizeof(DATA)) + (n + 7) / 8;
+}
+
+static size_t encode_block(unsigned char *out, const int *keys, DATA **data, int n, int compress) {
+    unsigned char *p = out, *bitmap;
+    int i;
+
+    if (compress) {
+        // Keys come sorted, so deltas are small and non-negative
+        p = put_varint(p, ((uint32_t)keys[0] << 1) ^ (uint32_t)(keys[0] >> 31));
+        for (i = 1; i < n; i++) {
+            p = put_varint(p, (uint32_t)keys[i] - (uint32_t)keys[i - 1]);
+        }
+    } else {
+        memcpy(p, keys, sizeof(int) * n);
+        p += sizeof(int) * n;
+    }
+
+    bitmap = p;
+    memset(bitmap, 0, (n + 7) / 8);
+    p += (n + 7) / 8;
+    for (i = 0; i < n; i++) {
+        if (data[i] != NULL) {
+            bitmap[i / 8] |= (unsigned char)(1 << (i % 8));
+            memcpy(p, data[i], sizeof(DATA));
+            p += sizeof(DATA);
+        }
+    }
+
+    return (size_t)(p - out);
+}
+
+// Decode one payload into entries, values go to *next_value; returns 0 on success
+static int decode_block(const unsigned char *p, size_t size, int n, int compress,
+                        ENTRY *entries, DATA **next_value) {
+    const unsigned char *end = p + size, *bitmap;
+    unsigned long long v;
+    int i;
+
+    // Keys and deltas are 32-bit, a longer varint means a corrupt block
+    if (compress) {
+        if (!(p = get_varint(p, end, &v)) || v > 0xFFFFFFFFu) {
+            return -1;
+        }
+        entries[0].key = (int)(((uint32_t)v >> 1) ^ (0u - ((uint32_t)v & 1)));
+        for (i = 1; i < n; i++) {
+            if (!(p = get_varint(p, end, &v)) || v > 0xFFFFFFFFu) {
+                return -1;
+            }
+            entries[i].key = (int)((uint32_t)entries[i - 1].key + (uint32_t)v);
+        }
+    } else {
+        if ((size_t)(end - p) < sizeof(int) * n) {
+            return -1;
+        }
+        for (i = 0; i < n; i++) {
+            memcpy(&entries[i].key, p, sizeof(int));
+            p += sizeof(int);
+        }
+    }
+
+    bitmap = p;
+    p += (n + 7) / 8;
+    if (p > end) {
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        entries[i].data = NULL;
+        if (bitmap[i / 8] & (1 << (i % 8))) {
+            if ((size_t)(end - p) < sizeof(DATA)) {
+                return -1;
+            }
+            memcpy(*next_value, p, sizeof(DATA));
+            entries[i].data = (*next_value)++;
+            p += sizeof(DATA);
+        }
+    }
+
+    return p == end ? 0 : -1;
+}
+
+// The n keys decoded at entries[start] must not go down, within the block or
+// from the previous block's last key; a wrapped delta or a shuffled raw block
+// would pass the CRC and hand build_from_sorted unsorted input
+static int keys_in_order(const ENTRY *entries, uint64_t start, int n) {
+    uint64_t i;
+
+    for (i = start > 0 ? start : 1; i < start + n; i++) {
+        if (entries[i].key < entries[i - 1].key) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int write_block(FILE *fp, unsigned char *buf, const int *keys, DATA **data, int n, int compress) {
+    BLOCK_HEADER block;
+
+    block.num_keys = (uint32_t)n;
+    block.payload_size = (uint32_t)encode_block(buf, keys, data, n, compress);
+    block.crc = crc32(buf, block.payload_size);
+
+    if (fwrite(&block, sizeof(block), 1, fp) != 1 ||
+        fwrite(buf, 1, block.payload_size, fp) != block.payload_size) {
+        return -1;
+    }
+    return 0;
+}
+
+int bptree_save(const char *path, int compress) {
+    SNAPSHOT_HEADER header;
+    unsigned char *buf;
+    DATA **data;
+    NODE *leaf;
+    FILE *fp;
+    int *keys;
+    int i, n = 0, ret = 0;
+
+    if (!(fp = fopen(path, "wb"))) {
+        return -1;
+    }
+    setvbuf(fp, NULL, _IOFBF, SNAPSHOT_IO_BUFFER);
+    crc_init();
+    bptree_flush();
+
+    if (!(keys = (int *)malloc(sizeof(int) * SNAPSHOT_BLOCK_KEYS))) ERR;
+    if (!(data = (DATA **)malloc(sizeof(DATA *) * SNAPSHOT_BLOCK_KEYS))) ERR;
+    if (!(buf = (unsigned char *)malloc(block_bound(SNAPSHOT_BLOCK_KEYS)))) ERR;
+
+    // Key count is patched in once the leaf chain has been written
+    memset(&header, 0, sizeof(header));
+    header.magic = SNAPSHOT_MAGIC;
+    header.version = SNAPSHOT_VERSION;
+    header.flags = compress ? SNAPSHOT_COMPRESSED : 0;
+    header.data_size = sizeof(DATA);
+    if (fwrite(&header, sizeof(header), 1, fp) != 1) {
+        ret = -1;
+    }
+
+    // Stream the leaf chain, one block at a time
+    leaf = g_root ? find_leftmost_leaf(g_root) : NULL;
+    while (leaf != NULL && ret == 0) {
+        leaf_sort(leaf);
+        for (i = 0; i < leaf->num_keys && ret == 0; i++) {
+            keys[n] = leaf->key[i];
+            data[n] = LEAF_DATA(leaf, i);
+            if (++n == SNAPSHOT_BLOCK_KEYS) {
+                ret = write_block(fp, buf, keys, data, n, compress);
+                header.num_keys += n;
+                n = 0;
+            }
+        }
+        leaf = NEXT_LEAF(leaf);
+    }
+    if (n > 0 && ret == 0) {
+        ret = write_block(fp, buf, keys, data, n, compress);
+        header.num_keys += n;
+    }
+
+    if (ret == 0 && (fseek(fp, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, fp) != 1)) {
+        ret = -1;
+    }
+    if (fclose(fp) != 0) {
+        ret = -1;
+    }
+
+    free(buf);
+    free(data);
+    free(keys);
+    return ret;
+}
+
+int bptree_load(const char *path, int num_threads) {
+    SNAPSHOT_HEADER header;
+    BLOCK_HEADER block;
+    unsigned char *buf;
+    ENTRY *entries;
+    DATA *values, *next_value;
+    FILE *fp;
+    uint64_t loaded = 0;
+    int ret = 0;
+
+    if (!(fp = fopen(path, "rb"))) {
+        return -1;
+    }
+    setvbuf(fp, NULL, _IOFBF, SNAPSHOT_IO_BUFFER);
+    posix_fadvise(fileno(fp), 0, 0, POSIX_FADV_SEQUENTIAL);
+    crc_init();
+
+    if (fread(&header, sizeof(header), 1, fp) != 1 || header.magic != SNAPSHOT_MAGIC ||
+        header.version != SNAPSHOT_VERSION || header.data_size != sizeof(DATA) ||
+        header.num_keys > 0x7FFFFFFF) {
+        fclose(fp);
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!(entries = (ENTRY *)malloc(sizeof(ENTRY) * (header.num_keys + 1)))) ERR;
+    if (!(values = (DATA *)malloc(sizeof(DATA) * (header.num_keys + 1)))) ERR;
+    if (!(buf = (unsigned char *)malloc(block_bound(SNAPSHOT_BLOCK_KEYS)))) ERR;
+    next_value = values;
+
+    // Decode every block before touching the tree, so a bad file leaves it intact
+    while (loaded < header.num_keys) {
+        if (fread(&block, sizeof(block), 1, fp) != 1 || block.num_keys == 0 ||
+            block.num_keys > SNAPSHOT_BLOCK_KEYS || block.num_keys > header.num_keys - loaded ||
+            block.payload_size > block_bound(block.num_keys) ||
+            fread(buf, 1, block.payload_size, fp) != block.payload_size ||
+            crc32(buf, block.payload_size) != block.crc ||
+            decode_block(buf, block.payload_size, (int)block.num_keys,
+                         header.flags & SNAPSHOT_COMPRESSED, entries + loaded, &next_value) != 0 ||
+            !keys_in_order(entries, loaded, (int)block.num_keys)) {
+            ret = -1;
+            break;
+        }
+        loaded += block.num_keys;
+    }
+    fclose(fp);
+    free(buf);
+
+    if (ret != 0) {
+        free(values);
+        free(entries);
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (num_threads < 1) {
+        num_threads = 1;
+    } else if (num_threads > MAX_BULK_THREADS) {
+        num_threads = MAX_BULK_THREADS;
+    }
+
+    bptree_destroy();
+    build_from_sorted(entries, (int)header.num_keys, num_threads);
+    free(entries);
+
+#ifdef BPTREE_COMPACT_REFS
+    // build_from_sorted copied the values into the data arena
+    free(values);
+#else
+    g_loaded_data = values;
+#endif
+
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,103 @@
+#include <string.h>
+
+#include "bptree.h"
+
+// Hot-path counters, bumped through STAT_INC
+COUNTERS g_counters;
+
+static void analyze_node(NODE *node, int depth, STATS *stats) {
+    int i, bucket;
+
+    if (depth + 1 > stats->height) {
+        stats->height = depth + 1;
+    }
+    if (depth < MAX_LEVELS) {
+        stats->nodes_per_level[depth]++;
+    }
+    stats->num_nodes++;
+
+    if (node->is_leaf == 1) {
+        stats->num_leaves++;
+        stats->num_keys += node->num_keys;
+
+        // Leaf fill in 10% buckets, a full leaf lands in the last one
+        bucket = node->num_keys * FILL_BUCKETS / (N - 1);
+        if (bucket >= FILL_BUCKETS) {
+            bucket = FILL_BUCKETS - 1;
+        }
+        stats->leaf_fill_histogram[bucket]++;
+        return;
+    }
+
+    stats->num_children += node->num_keys + 1;
+#ifdef BPTREE_BEPSILON
+    stats->pending_msgs += node->num_msgs;
+    stats->bytes += (long long)node->buffer_cap * sizeof(MESSAGE);
+#endif
+    for (i = 0; i < node->num_keys + 1; i++) {
+        analyze_node(CHILD(node, i), depth + 1, stats);
+    }
+}
+
+void bptree_stats(STATS *stats) {
+    memset(stats, 0, sizeof(STATS));
+
+    if (g_root != NULL) {
+        analyze_node(g_root, 0, stats);
+    }
+
+    stats->bytes += stats->num_nodes * (long long)sizeof(NODE);
+    if (stats->num_leaves > 0) {
+        stats->leaf_fill = (double)stats->num_keys / (stats->num_leaves * (N - 1));
+    }
+    if (stats->num_nodes > stats->num_leaves) {
+        stats->internal_fill = (double)stats->num_children / ((stats->num_nodes - stats->num_leaves) * N);
+    }
+    stats->counters = g_counters;
+}
+
+void bptree_stats_reset(void) {
+    memset(&g_counters, 0, sizeof(COUNTERS));
+}
+
+void bptree_stats_print(STATS *stats) {
+    int i;
+
+    printf("height: %d, keys: %lld, fanout: %d\n", stats->height, stats->num_keys, N);
+    printf("nodes: %lld (leaves %lld, internal %lld)\n", stats->num_nodes,
+           stats->num_leaves, stats->num_nodes - stats->num_leaves);
+    for (i = 0; i < stats->height && i < MAX_LEVELS; i++) {
+        printf("  level %d: %lld nodes\n", i, stats->nodes_per_level[i]);
+    }
+    printf("bytes: %lld (%.1f per key)\n", stats->bytes,
+           stats->num_keys > 0 ? (double)stats->bytes / stats->num_keys : 0.0);
+    printf("fill: leaf %.1f%%, internal %.1f%%\n", stats->leaf_fill * 100, stats->internal_fill * 100);
+    for (i = 0; i < FILL_BUCKETS; i++) {
+        printf("  %3d-%3d%%: %lld leaves\n", i * 100 / FILL_BUCKETS,
+               (i + 1) * 100 / FILL_BUCKETS, stats->leaf_fill_histogram[i]);
+    }
+
+#ifndef BPTREE_NO_STATS
+    printf("inserts: %lld (append fast path %lld), updates: %lld, deletes: %lld\n", stats->counters.inserts,
+           stats->counters.append_inserts, stats->counters.updates, stats->counters.deletes);
+    printf("splits: leaf %lld, internal %lld, root %lld\n", stats->counters.leaf_splits,
+           stats->counters.internal_splits, stats->counters.root_splits);
+    printf("merges: leaf %lld, internal %lld, root shrinks %lld\n", stats->counters.leaf_merges,
+           stats->counters.internal_merges, stats->counters.root_shrinks);
+    printf("borrows: leaf %lld, internal %lld\n", stats->counters.leaf_borrows,
+           stats->counters.internal_borrows);
+    if (g_filter.enabled) {
+        printf("filter: %.1f MB for %lld keys, %lld misses answered without a descent\n",
+               g_filter.num_blocks * FILTER_BLOCK / 1e6, g_filter.num_keys, stats->counters.filter_negatives);
+    }
+#endif
+    if (g_layer.enabled) {
+        printf("layer: depth %d, %d fences, %.1f KB, %lld rebuilds\n", g_layer.depth, g_layer.num_fences,
+               g_layer.num_fences * (sizeof(int) + sizeof(NODE *)) / 1e3, g_layer.rebuilds);
+    }
+#ifdef BPTREE_BEPSILON
+    printf("buffers: %lld pending, %lld buffered, %lld batches flushed\n", stats->pending_msgs,
+           stats->counters.buffered_msgs, stats->counters.buffer_flushes);
+#endif
+    fflush(stdout);
+}
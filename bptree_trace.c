@@ -0,0 +1,259 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bptree.h"
+
+// Trace file layout (host byte order):
+//   TRACE_HEADER
+//   one record per sampled operation, all fields varints:
+//     (nanoseconds since the previous record << 4) | op
+//     zigzag delta of the key from the previous record's key
+//     zigzag (end key - key), range operations only
+#define TRACE_MAGIC 0x54545042u         // "BPTT"
+#define TRACE_VERSION 2              // version 1 kept the op in 3 bits
+#define TRACE_MAX_RECORD 20             // 10 + 5 + 5 varint bytes
+
+typedef struct trace_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t sample_ppm;        // sampling rate in parts per million
+    uint32_t reserved;
+} TRACE_HEADER;
+
+TRACE g_trace;
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+// Signed 32-bit difference b - a, zigzag encoded so small steps either way stay short
+static uint32_t zigzag_delta(int a, int b) {
+    int32_t d = (int32_t)((uint32_t)b - (uint32_t)a);
+
+    return ((uint32_t)d << 1) ^ (uint32_t)(d >> 31);
+}
+
+static int unzigzag_add(int a, uint64_t v) {
+    uint32_t d = (uint32_t)(v >> 1) ^ (0u - (uint32_t)(v & 1));
+
+    return (int)((uint32_t)a + d);
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = (const char *)buf;
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Hand the buffered records to the kernel; after a failed write records are dropped
+static void flush_trace(void) {
+    if (g_trace.error == 0 && write_all(g_trace.fd, g_trace.buffer, g_trace.used) != 0) {
+        g_trace.error = errno;
+    }
+    g_trace.used = 0;
+}
+
+int bptree_trace_start(const char *path, double sample_rate) {
+    TRACE_HEADER header;
+    int fd;
+
+    if (g_trace.active) {
+        errno = EBUSY;
+        return -1;
+    }
+    if (!(sample_rate > 0 && sample_rate <= 1)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        return -1;
+    }
+    header.magic = TRACE_MAGIC;
+    header.version = TRACE_VERSION;
+    header.sample_ppm = (uint32_t)(sample_rate * 1000000 + 0.5);
+    header.reserved = 0;
+    if (write_all(fd, &header, sizeof(header)) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    memset(&g_trace, 0, sizeof(g_trace));
+    if (!(g_trace.buffer = (unsigned char *)malloc(TRACE_BUFFER))) ERR;
+    g_trace.fd = fd;
+    g_trace.sample_cut = sample_rate >= 1 ? 1ULL << 32 : (unsigned long long)(sample_rate * 4294967296.0);
+    g_trace.rng = 88172645463325252ULL;
+    g_trace.last_ns = now_ns();
+    g_trace.active = 1;
+    return 0;
+}
+
+int bptree_trace_stop(void) {
+    int error;
+
+    if (!g_trace.active) {
+        return 0;
+    }
+    flush_trace();
+    if (close(g_trace.fd) != 0 && g_trace.error == 0) {
+        g_trace.error = errno;
+    }
+    free(g_trace.buffer);
+    g_trace.buffer = NULL;
+    g_trace.active = 0;
+
+    error = g_trace.error;
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+void trace_record(int op, int key, int arg) {
+    unsigned long long now;
+    unsigned char *p;
+
+    g_trace.seen++;
+    if (g_trace.sample_cut <= 0xFFFFFFFFULL) {
+        // xorshift64, only the sampling decision needs to be cheap, not strong
+        g_trace.rng ^= g_trace.rng << 13;
+        g_trace.rng ^= g_trace.rng >> 7;
+        g_trace.rng ^= g_trace.rng << 17;
+        if ((g_trace.rng >> 32) >= g_trace.sample_cut) {
+            return;
+        }
+    }
+
+    now = now_ns();
+    p = g_trace.buffer + g_trace.used;
+    p = put_varint(p, (now - g_trace.last_ns) << 4 | (unsigned)op);
+    p = put_varint(p, zigzag_delta(g_trace.last_key, key));
+    if (op == TRACE_RANGE || op == TRACE_DELRANGE) {
+        p = put_varint(p, zigzag_delta(key, arg));
+    }
+    g_trace.used = (size_t)(p - g_trace.buffer);
+    g_trace.last_ns = now;
+    g_trace.last_key = key;
+    g_trace.recorded++;
+
+    // Keep room for one more record of the largest size
+    if (g_trace.used > TRACE_BUFFER - TRACE_MAX_RECORD) {
+        flush_trace();
+    }
+}
+
+int bptree_trace_open(TRACE_READER *reader, const char *path) {
+    TRACE_HEADER header;
+    ssize_t n;
+
+    memset(reader, 0, sizeof(TRACE_READER));
+    if ((reader->fd = open(path, O_RDONLY)) < 0) {
+        return -1;
+    }
+    n = read(reader->fd, &header, sizeof(header));
+    if (n != (ssize_t)sizeof(header) || header.magic != TRACE_MAGIC || header.version != TRACE_VERSION) {
+        close(reader->fd);
+        reader->fd = -1;
+        errno = EINVAL;
+        return -1;
+    }
+    if (!(reader->buffer = (unsigned char *)malloc(TRACE_BUFFER))) ERR;
+    reader->sample_rate = header.sample_ppm / 1e6;
+    return 0;
+}
+
+// Make sure a whole record is buffered unless the file ends first
+static int fill_reader(TRACE_READER *reader) {
+    ssize_t n;
+
+    if (reader->eof || reader->len - reader->pos >= TRACE_MAX_RECORD) {
+        return 0;
+    }
+    memmove(reader->buffer, reader->buffer + reader->pos, reader->len - reader->pos);
+    reader->len -= reader->pos;
+    reader->pos = 0;
+    while (reader->len < TRACE_BUFFER) {
+        n = read(reader->fd, reader->buffer + reader->len, TRACE_BUFFER - reader->len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            reader->eof = 1;
+            break;
+        }
+        reader->len += (size_t)n;
+    }
+    return 0;
+}
+
+int bptree_trace_next(TRACE_READER *reader, TRACE_RECORD *record) {
+    const unsigned char *p, *end;
+    unsigned long long v;
+
+    if (fill_reader(reader) != 0) {
+        return -1;
+    }
+    if (reader->pos == reader->len) {
+        return 0;
+    }
+
+    p = reader->buffer + reader->pos;
+    end = reader->buffer + reader->len;
+    if (!(p = get_varint(p, end, &v)) || (v & 15) >= TRACE_OPS) {
+        return -1;
+    }
+    reader->time_ns += v >> 4;
+    record->op = (int)(v & 15);
+    record->time_ns = reader->time_ns;
+
+    if (!(p = get_varint(p, end, &v))) {
+        return -1;
+    }
+    record->key = unzigzag_add(reader->last_key, v);
+    reader->last_key = record->key;
+
+    record->arg = 0;
+    if (record->op == TRACE_RANGE || record->op == TRACE_DELRANGE) {
+        if (!(p = get_varint(p, end, &v))) {
+            return -1;
+        }
+        record->arg = unzigzag_add(record->key, v);
+    }
+
+    reader->pos = (size_t)(p - reader->buffer);
+    return 1;
+}
+
+void bptree_trace_close(TRACE_READER *reader) {
+    if (reader->fd >= 0) {
+        close(reader->fd);
+    }
+    free(reader->buffer);
+    reader->buffer = NULL;
+    reader->fd = -1;
+}
\ No newline at end of file
@@ -1,5 +1,11 @@
+#include <string.h>
+
 #include "bptree.h"
 
+#if defined(BPTREE_UNSORTED_LEAVES) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 NODE *find_leaf(NODE *node, int key) {
     int kid;
 
@@ -16,7 +22,22 @@ NODE *find_leaf(NODE *node, int key) {
     }
 
     // Recursively search in child node
-    return find_leaf(node->child[kid], key);
+    return find_leaf(NODE_AT(node->child[kid]), key);
+}
+
+NODE *find_leaf_first(NODE *node, int key) {
+    int kid;
+
+    // Copies of a separator key can sit on both sides of it, so go left on equality
+    while (node->is_leaf == 0) {
+        for (kid = 0; kid < node->num_keys; kid++) {
+            if (key <= node->key[kid]) {
+                break;
+            }
+        }
+        node = NODE_AT(node->child[kid]);
+    }
+    return node;
 }
 
 
@@ -25,24 +46,24 @@ NODE *find_sibling_node(NODE *node, NODE *child_node) {
 
     // Find the position of child_node in parent's children array
     for (i = 0; i < node->num_keys + 1; i++) {
-        if (node->child[i] == child_node) {
+        if (CHILD(node, i) == child_node) {
             break;
         }
     }
 
     // If leftmost child, return right sibling; otherwise return left sibling
     if (i == 0) {
-        return node->child[i + 1];
+        return CHILD(node, i + 1);
     } else {
-        return node->child[i - 1];
+        return CHILD(node, i - 1);
     }
 }
 
 int find_parent_key(NODE *parent_node, NODE *child_node, NODE *sibling_node) {
     int i;
     for (i = 0; i < parent_node->num_keys; i++) {
-        if (parent_node->child[i] == child_node || 
-            parent_node->child[i] == sibling_node) {
+        if (CHILD(parent_node, i) == child_node || 
+            CHILD(parent_node, i) == sibling_node) {
             break;
         }
     }
@@ -52,8 +73,139 @@ int find_parent_key(NODE *parent_node, NODE *child_node, NODE *sibling_node) {
 
 NODE *find_leftmost_leaf(NODE *node) {
     while (node && !node->is_leaf) {
-        node = node->child[0];
+        node = CHILD(node, 0);
     }
     
     return node;
+}
+
+unsigned char key_fingerprint(int key) {
+    // Multiplicative hash, top byte
+    return (unsigned char)(((unsigned int)key * 2654435761u) >> 24);
+}
+
+unsigned char *put_varint(unsigned char *p, unsigned long long v) {
+    while (v >= 0x80) {
+        *p++ = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (unsigned char)v;
+    return p;
+}
+
+const unsigned char *get_varint(const unsigned char *p, const unsigned char *end, unsigned long long *v) {
+    int shift;
+
+    *v = 0;
+    for (shift = 0; shift < 70 && p < end; shift += 7) {
+        *v |= (unsigned long long)(*p & 0x7F) << shift;
+        if ((*p++ & 0x80) == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+int leaf_find(NODE *leaf, int key) {
+    int i = 0;
+
+#ifdef BPTREE_UNSORTED_LEAVES
+    unsigned char fp = key_fingerprint(key);
+
+#ifdef __SSE2__
+    // Compare 16 fingerprints at once, only matching slots touch the keys
+    __m128i needle = _mm_set1_epi8((char)fp);
+    unsigned int mask;
+
+    for (; i + 16 <= leaf->num_keys; i += 16) {
+        mask = (unsigned int)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(needle, _mm_loadu_si128((const __m128i *)(leaf->fp + i))));
+        while (mask != 0) {
+            if (leaf->key[i + __builtin_ctz(mask)] == key) {
+                return i + __builtin_ctz(mask);
+            }
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; i < leaf->num_keys; i++) {
+        if (leaf->fp[i] == fp && leaf->key[i] == key) {
+            return i;
+        }
+    }
+#else
+    // Sorted leaf: stop at the first larger key
+    for (; i < leaf->num_keys && leaf->key[i] <= key; i++) {
+        if (leaf->key[i] == key) {
+            return i;
+        }
+    }
+#endif
+
+    return -1;
+}
+
+int leaf_find_first(NODE **leaf, int key) {
+    NODE *next;
+    int i = leaf_find(*leaf, key);
+
+    if (i >= 0 || (next = NEXT_LEAF(*leaf)) == NULL) {
+        return i;
+    }
+#ifndef BPTREE_UNSORTED_LEAVES
+    // A sorted leaf with a larger key would have held key if it were present
+    if ((*leaf)->num_keys > 0 && (*leaf)->key[(*leaf)->num_keys - 1] > key) {
+        return -1;
+    }
+#endif
+    if ((i = leaf_find(next, key)) >= 0) {
+        *leaf = next;
+    }
+    return i;
+}
+
+int leaf_find_routed(NODE **leaf, int key) {
+    NODE *first;
+    int i = leaf_find(*leaf, key), j;
+
+    if (i >= 0) {
+        return i;
+    }
+    // A leaf holding a smaller key lies wholly right of its lower separator, so
+    // that separator is below key and no copy can be on the other side of it
+    for (j = 0; j < (*leaf)->num_keys; j++) {
+        if ((*leaf)->key[j] < key) {
+            return -1;
+        }
+    }
+    first = find_leaf_first(g_root, key);
+    if ((i = leaf_find_first(&first, key)) >= 0) {
+        *leaf = first;
+    }
+    return i;
+}
+
+void leaf_sort(NODE *leaf) {
+#ifdef BPTREE_UNSORTED_LEAVES
+    int i, j, key;
+    NODE_REF data;
+    unsigned char fp;
+
+    // Insertion sort, cheap when the leaf is already (nearly) sorted
+    for (i = 1; i < leaf->num_keys; i++) {
+        key = leaf->key[i];
+        data = leaf->child[i];
+        fp = leaf->fp[i];
+        for (j = i; j > 0 && leaf->key[j - 1] > key; j--) {
+            leaf->key[j] = leaf->key[j - 1];
+            leaf->child[j] = leaf->child[j - 1];
+            leaf->fp[j] = leaf->fp[j - 1];
+        }
+        leaf->key[j] = key;
+        leaf->child[j] = data;
+        leaf->fp[j] = fp;
+    }
+#else
+    (void)leaf;
+#endif
 }
\ No newline at end of file
@@ -5,7 +5,7 @@
 #include "bptree.h"
 
 void show_usage(void) {
-    printf("Usage: add <key> | del <key> | scan | range <start> <end> | exit\n");
+    printf("Usage: add <key> | del <key> | scan | range <start> <end> | delrange <start> <end> | stats | save <file> | load <file> | trace <file> [rate] | trace off | exit\n");
 }
 
 int main(int argc, char *argv[]) {
@@ -14,7 +14,10 @@ int main(int argc, char *argv[]) {
     
     char line[100];
     char cmd[10];
-    int key, start_key, end_key;
+    char path[90];
+    int key, start_key, end_key, n;
+    double rate;
+    STATS stats;
 
     bptree_init();
     show_usage();
@@ -32,12 +35,53 @@ int main(int argc, char *argv[]) {
             break;
         } else if (strcmp(cmd, "scan") == 0) {
             bptree_scan_all();
+        } else if (strcmp(cmd, "stats") == 0) {
+            bptree_stats(&stats);
+            bptree_stats_print(&stats);
+        } else if (strcmp(cmd, "save") == 0) {
+            if (sscanf(line, "%s %89s", cmd, path) != 2) {
+                show_usage();
+                continue;
+            }
+            if (bptree_save(path, 1) != 0) {
+                perror(path);
+            }
+        } else if (strcmp(cmd, "load") == 0) {
+            if (sscanf(line, "%s %89s", cmd, path) != 2) {
+                show_usage();
+                continue;
+            }
+            if (bptree_load(path, 1) != 0) {
+                perror(path);
+            }
+            bptree_print(g_root);
+        } else if (strcmp(cmd, "trace") == 0) {
+            rate = 1.0;
+            n = sscanf(line, "%s %89s %lf", cmd, path, &rate);
+            if (n < 2) {
+                show_usage();
+                continue;
+            }
+            if (strcmp(path, "off") == 0) {
+                if (bptree_trace_stop() != 0) {
+                    perror("trace");
+                }
+            } else if (bptree_trace_start(path, rate) != 0) {
+                perror(path);
+            }
         } else if (strcmp(cmd, "range") == 0) {
             if (sscanf(line, "%s %d %d", cmd, &start_key, &end_key) != 3) {
                 show_usage();
                 continue;
             }
             bptree_scan_range(start_key, end_key);
+        } else if (strcmp(cmd, "delrange") == 0) {
+            if (sscanf(line, "%s %d %d", cmd, &start_key, &end_key) != 3) {
+                show_usage();
+                continue;
+            }
+            bptree_delete_range(start_key, end_key);
+            bptree_print(g_root);
         } else if (strcmp(cmd, "add") == 0) {
             if (sscanf(line, "%s %d", cmd, &key) != 2) {
                 show_usage();
@@ -60,5 +104,8 @@ int main(int argc, char *argv[]) {
         printf("--------------------------------------\n");
     }
 
+    if (bptree_trace_stop() != 0) {
+        perror("trace");
+    }
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,350 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#include "bptree.h"
+
+// bptree_split / bptree_join のランダムテスト
+// 分割・結合のたびに bptree_verify で不変条件を確認し、参照配列と中身を突き合わせる
+
+#define KEY_RANGE 50000     // キーの範囲 [0, KEY_RANGE)
+#define N_ROUNDS 200        // 分割・結合の回数
+#define N_SEEDS 5
+#define DUP_KEYS 200        // 重複テストのキーの種類
+#define DUP_COPIES 10       // 重複テストの各キーの個数
+
+static char present[KEY_RANGE];
+static DATA values[KEY_RANGE];
+
+// 木の中身が [lo, hi) の参照と一致するか、bptree_verify の範囲指定と葉のリンクで確認する
+// bptree_verify は右端の経路以外のノードの最小充填率も確認するので、
+// 分割・結合・範囲削除の継ぎ目が充填不足のまま残ると失敗する
+static int check_tree(NODE *root, int lo, int hi, const char *what, int round) {
+    long count = bptree_verify(root, lo, hi - 1), expect = 0;
+    NODE *leaf;
+    int i, key;
+
+    for (key = lo; key < hi; key++) {
+        expect += present[key];
+    }
+    if (count != expect) {
+        fprintf(stderr, "[FAIL] round %d %s: verify=%ld expected=%ld\n", round, what, count, expect);
+        return 1;
+    }
+
+    leaf = root ? find_leftmost_leaf(root) : NULL;
+    for (; leaf != NULL; leaf = NEXT_LEAF(leaf)) {
+        for (i = 0; i < leaf->num_keys; i++) {
+            key = leaf->key[i];
+            if (key < lo || key >= hi || !present[key] || LEAF_DATA(leaf, i)->value != values[key].value) {
+                fprintf(stderr, "[FAIL] round %d %s: unexpected key %d\n", round, what, key);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int run(unsigned seed) {
+    NODE *high, *low;
+    DATA *data;
+    int round, i, key, end, split_key, cut;
+
+    srand(seed);
+    bptree_init();
+
+    // 昇順の挿入(追記の高速パス)とランダム挿入・削除を混ぜて木を作る
+    for (key = 0; key < KEY_RANGE; key += 1 + rand() % 3) {
+        bptree_insert(key, &values[key]);
+        present[key] = 1;
+    }
+    for (i = 0; i < KEY_RANGE; i++) {
+        key = rand() % KEY_RANGE;
+        if (present[key]) {
+            bptree_delete(key);
+            present[key] = 0;
+        } else {
+            bptree_insert(key, &values[key]);
+            present[key] = 1;
+        }
+    }
+    // B-epsilon 木では保留中のメッセージを葉に反映してから検証する
+    bptree_flush();
+    if (check_tree(g_root, 0, KEY_RANGE, "build", 0)) return 1;
+
+    for (round = 1; round <= N_ROUNDS; round++) {
+        // 範囲外の分割キーも混ぜる
+        split_key = rand() % (KEY_RANGE + 200) - 100;
+
+        cut = split_key < 0 ? 0 : split_key > KEY_RANGE ? KEY_RANGE : split_key;
+
+        high = bptree_split(split_key);
+        if (check_tree(g_root, 0, cut, "split low", round)) return 1;
+        if (check_tree(high, cut, KEY_RANGE, "split high", round)) return 1;
+
+        // 範囲が重なる木(ここでは自分自身)との結合は拒否される
+        if (g_root->num_keys > 0 && bptree_join(g_root) != -1) {
+            fprintf(stderr, "[FAIL] round %d: overlapping join accepted\n", round);
+            return 1;
+        }
+
+        // 下側の一部を範囲削除する
+        if (cut > 0) {
+            key = rand() % cut;
+            end = key + rand() % 500;
+            bptree_delete_range(key, end);
+            for (; key <= end && key < cut; key++) {
+                present[key] = 0;
+            }
+            if (check_tree(g_root, 0, cut, "delrange", round)) return 1;
+        }
+
+        // 分割した両側を少し更新してから結合する
+        for (i = 0; i < 20; i++) {
+            key = rand() % KEY_RANGE;
+            if (key < split_key && !present[key]) {
+                bptree_insert(key, &values[key]);
+                present[key] = 1;
+            } else if (key < split_key) {
+                bptree_delete(key);
+                present[key] = 0;
+            }
+        }
+
+        if (rand() % 2) {
+            // 上側を下側の後ろに結合
+            if (bptree_join(high) != 0) {
+                fprintf(stderr, "[FAIL] round %d: join high failed\n", round);
+                return 1;
+            }
+        } else {
+            // 下側を切り離し、上側を根にしてから下側を前に結合
+            low = bptree_split(INT_MIN);
+            if (bptree_join(high) != 0 || bptree_join(low) != 0) {
+                fprintf(stderr, "[FAIL] round %d: join low failed\n", round);
+                return 1;
+            }
+        }
+        bptree_flush();
+        if (check_tree(g_root, 0, KEY_RANGE, "join", round)) return 1;
+
+        // 結合後も探索が通常どおり動く
+        key = rand() % KEY_RANGE;
+        if (bptree_get(key, &data) != present[key]) {
+            fprintf(stderr, "[FAIL] round %d: lookup of %d\n", round, key);
+            return 1;
+        }
+    }
+
+    bptree_destroy();
+    for (key = 0; key < KEY_RANGE; key++) {
+        present[key] = 0;
+    }
+    return 0;
+}
+
+// [lo, hi] に入るキーの数を葉のリンクを辿って数える
+static long count_keys(NODE *root, int lo, int hi) {
+    NODE *leaf;
+    long count = 0;
+    int i;
+
+    for (leaf = find_leftmost_leaf(root); leaf != NULL; leaf = NEXT_LEAF(leaf)) {
+        for (i = 0; i < leaf->num_keys; i++) {
+            count += leaf->key[i] >= lo && leaf->key[i] <= hi;
+        }
+    }
+    return count;
+}
+
+// 点検索と multi-get が探索レイヤーの有無にかかわらず [0, DUP_KEYS) を全部見つけるか確認する
+static int check_dup_lookups(const char *what) {
+    static DATA *found[DUP_KEYS + 1];
+    int keys[DUP_KEYS + 1];
+    int i, n, layer;
+
+    for (i = 0; i <= DUP_KEYS; i++) {
+        keys[i] = i;
+    }
+    for (layer = 0; layer < 2; layer++) {
+        if (layer) {
+            bptree_layer_enable(0);
+        }
+        for (i = 0; i <= DUP_KEYS; i++) {
+            if (bptree_get(i, NULL) != (i < DUP_KEYS)) {
+                fprintf(stderr, "[FAIL] %s: dup get %d (layer=%d)\n", what, i, layer);
+                return 1;
+            }
+        }
+        if ((n = bptree_multi_get(keys, DUP_KEYS + 1, found)) != DUP_KEYS || found[DUP_KEYS] != NULL) {
+            fprintf(stderr, "[FAIL] %s: dup multi-get found %d (layer=%d)\n", what, n, layer);
+            return 1;
+        }
+    }
+    bptree_layer_disable();
+    return 0;
+}
+
+// 重複キーのテスト: 各キーを DUP_COPIES 個ずつ挿入する
+// 同じキーが区切りキーの左右の葉にまたがるので、等しい区切りで左へ降りないと取りこぼす
+static int run_duplicates(void) {
+    static int keys[DUP_KEYS * DUP_COPIES];
+    AGGREGATE agg;
+    NODE *high;
+    int i, n, key;
+
+    bptree_init();
+    for (i = 0; i < DUP_KEYS * DUP_COPIES; i++) {
+        bptree_insert(i / DUP_COPIES, &values[i / DUP_COPIES]);
+    }
+    bptree_flush();
+
+    // 並列範囲走査は各タスクの開始キーの重複を全部拾う
+    n = bptree_parallel_range(0, DUP_KEYS - 1, 4, keys, DUP_KEYS * DUP_COPIES);
+    if (n != DUP_KEYS * DUP_COPIES) {
+        fprintf(stderr, "[FAIL] dup parallel range: %d keys\n", n);
+        return 1;
+    }
+    for (i = 0; i < n; i++) {
+        if (keys[i] != i / DUP_COPIES) {
+            fprintf(stderr, "[FAIL] dup parallel range: keys[%d]=%d\n", i, keys[i]);
+            return 1;
+        }
+    }
+    bptree_parallel_aggregate(0, DUP_KEYS - 1, 4, &agg);
+    if (agg.count != DUP_KEYS * DUP_COPIES) {
+        fprintf(stderr, "[FAIL] dup parallel aggregate: count=%lld\n", agg.count);
+        return 1;
+    }
+
+    if (check_dup_lookups("insert")) return 1;
+
+    // 範囲削除は両端のキーが区切りの左右にまたがっていても全部消す
+    bptree_delete_range(50, 100);
+    if (bptree_verify(g_root, 0, DUP_KEYS - 1) != (DUP_KEYS - 51) * DUP_COPIES || count_keys(g_root, 50, 100) != 0) {
+        fprintf(stderr, "[FAIL] dup delrange: %ld keys, %ld left in range\n", bptree_verify(g_root, 0, DUP_KEYS - 1),
+                count_keys(g_root, 50, 100));
+        return 1;
+    }
+
+    // 分割キーの重複はすべて上側に移り、下側は分割キー未満だけになる
+    high = bptree_split(150);
+    if (bptree_verify(g_root, 0, 149) != 99 * DUP_COPIES || bptree_verify(high, 150, DUP_KEYS - 1) != 50 * DUP_COPIES) {
+        fprintf(stderr, "[FAIL] dup split: low=%ld high=%ld\n", bptree_verify(g_root, 0, 149),
+                bptree_verify(high, 150, DUP_KEYS - 1));
+        return 1;
+    }
+    if (bptree_join(high) != 0 || bptree_verify(g_root, 0, DUP_KEYS - 1) != 149 * DUP_COPIES) {
+        fprintf(stderr, "[FAIL] dup join\n");
+        return 1;
+    }
+
+    // 範囲削除したキーを戻してから、各キーを 1 個だけ残して削除する
+    // 残りの 1 個が区切りの左の葉にあっても削除・検索できる
+    for (key = 50; key <= 100; key++) {
+        for (i = 0; i < DUP_COPIES; i++) {
+            bptree_insert(key, &values[key]);
+        }
+    }
+    for (key = 0; key < DUP_KEYS; key++) {
+        for (i = 1; i < DUP_COPIES; i++) {
+            bptree_delete(key);
+        }
+    }
+    bptree_flush();
+    if ((n = bptree_verify(g_root, 0, DUP_KEYS - 1)) != DUP_KEYS) {
+        fprintf(stderr, "[FAIL] dup delete: %d keys\n", n);
+        return 1;
+    }
+    if (check_dup_lookups("delete")) return 1;
+
+    // 残りの 1 個が区切りの左にあっても upsert 系は既存キーとして扱い、増やさない
+    for (key = 0; key < DUP_KEYS; key++) {
+        bptree_upsert(key, &values[key]);
+        if (bptree_insert_unique(key, &values[key]) || !bptree_get_or_insert(key, &values[key], NULL)) {
+            fprintf(stderr, "[FAIL] dup upsert: key %d inserted again\n", key);
+            return 1;
+        }
+    }
+    bptree_flush();
+    if ((n = bptree_verify(g_root, 0, DUP_KEYS - 1)) != DUP_KEYS) {
+        fprintf(stderr, "[FAIL] dup upsert: %d keys\n", n);
+        return 1;
+    }
+
+    bptree_destroy();
+    return 0;
+}
+
+#ifdef BPTREE_COMPACT_REFS
+// 共有メモリの読み手も等しい区切りで左へ降り、重複を取りこぼさない
+static int run_shm_duplicates(void) {
+    SHM_READER reader;
+    AGGREGATE agg;
+    int i, key, found = 0;
+
+    bptree_init();
+    if (bptree_shm_create("/bptree-test-dup") != 0 || bptree_shm_open(&reader, "/bptree-test-dup") != 0) {
+        perror("shm");
+        return 1;
+    }
+    bptree_shm_write_begin();
+    for (i = 0; i < DUP_KEYS * DUP_COPIES; i++) {
+        bptree_insert(i / DUP_COPIES, &values[i / DUP_COPIES]);
+    }
+    bptree_shm_write_end();
+
+    bptree_shm_aggregate(&reader, 0, DUP_KEYS - 1, &agg);
+    if (agg.count != DUP_KEYS * DUP_COPIES) {
+        fprintf(stderr, "[FAIL] shm dup aggregate: count=%lld\n", agg.count);
+        return 1;
+    }
+
+    // 各キーを 1 個だけ残すと、残りが区切りの左の葉だけにあるキーが出る
+    bptree_shm_write_begin();
+    for (key = 0; key < DUP_KEYS; key++) {
+        for (i = 1; i < DUP_COPIES; i++) {
+            bptree_delete(key);
+        }
+    }
+    bptree_shm_write_end();
+    for (key = 0; key < DUP_KEYS; key++) {
+        found += bptree_shm_get(&reader, key, NULL);
+    }
+    if (found != DUP_KEYS || bptree_shm_get(&reader, DUP_KEYS, NULL)) {
+        fprintf(stderr, "[FAIL] shm dup get: %d found\n", found);
+        return 1;
+    }
+
+    bptree_shm_close(&reader);
+    bptree_shm_destroy();
+    return 0;
+}
+#endif
+
+int main(void) {
+    unsigned seed;
+
+    for (seed = 0; seed < KEY_RANGE; seed++) {
+        values[seed].value = (int)seed * 3 + 1;
+    }
+
+    for (seed = 1; seed <= N_SEEDS; seed++) {
+        if (run(seed) != 0) {
+            fprintf(stderr, "seed=%u\n", seed);
+            return 1;
+        }
+    }
+
+    if (run_duplicates() != 0) {
+        return 1;
+    }
+#ifdef BPTREE_COMPACT_REFS
+    if (run_shm_duplicates() != 0) {
+        return 1;
+    }
+#endif
+
+    printf("split/join テスト成功 ✅  seeds=%d rounds=%d\n", N_SEEDS, N_ROUNDS);
+    return 0;
+}